@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include "metrics.h"
+#include "cpu_executor.h"
+
+struct Hypothesis {
+  std::vector<int> yseq; // starts with sos
+  float score = 0.f;
+};
+
+// Optional per step metrics of a search. The running hypotheses of a step are
+// the batch a batched decoder would run, hypotheses / capacity is its fill.
+struct SearchMetrics {
+  Metrics* metrics = nullptr;
+  int step = -1;       // histogram, one decoder call
+  int steps = -1;      // counter, decoder calls
+  int hypotheses = -1; // counter, running hypotheses per step
+  int capacity = -1;   // counter, beam per step
+};
+
+// Attention beam search over the decoder graph. Every step re-runs the decoder
+// on the full prefix of each running hypothesis and extends it with the topk
+// tokens of the last position, as the TensorRT decoder engine does.
+class BeamSearch {
+public:
+  BeamSearch(CpuExecutor& decoder, int sos, int eos, int beam, float penalty,
+    const SearchMetrics& metrics = SearchMetrics())
+    : decoder(decoder), sos(sos), eos(eos), beam(beam), penalty(penalty), metrics(metrics) {}
+
+  // tokens of the best hypothesis without sos/eos
+  std::vector<int> search(const float* memory, int frames, int odim, int maxlen) {
+    Hypothesis start;
+    start.yseq.push_back(sos);
+    return search(memory, frames, odim, maxlen, start, nullptr, nullptr, 0);
+  }
+
+  // resumes from start; when seed_prob/seed_index are given they are the topk
+  // after start.yseq and the first decoder call is skipped
+  std::vector<int> search(const float* memory, int frames, int odim, int maxlen,
+    const Hypothesis& start, const float* seed_prob, const int* seed_index, int seed_k) {
+    std::vector<Hypothesis> running(1, start), ended;
+
+    struct Candidate { float score; int hyp; int token; };
+    std::vector<Candidate> candidates;
+    for (int i = (int)start.yseq.size() - 1; i < maxlen && !running.empty(); ++i) {
+      candidates.clear();
+      if (metrics.metrics) {
+        metrics.metrics->add(metrics.hypotheses, running.size());
+        metrics.metrics->add(metrics.capacity, beam);
+      }
+      for (int h = 0; h < (int)running.size(); ++h) {
+        Shape shape{ 1, seed_k };
+        const float* prob = seed_prob;
+        const int* index = seed_index;
+        if (prob)
+          seed_prob = nullptr;
+        else
+          step(running[h].yseq, memory, frames, odim, shape, prob, index);
+        for (int j = 0; j < std::min(shape.last(), beam); ++j)
+          candidates.push_back({ running[h].score + std::log(prob[j]), h, index[j] });
+      }
+      int keep = std::min((int)candidates.size(), beam);
+      std::partial_sort(candidates.begin(), candidates.begin() + keep, candidates.end(),
+        [](const Candidate& a, const Candidate& b) { return a.score > b.score; });
+
+      std::vector<Hypothesis> next;
+      for (int c = 0; c < keep; ++c) {
+        Hypothesis hyp;
+        hyp.yseq = running[candidates[c].hyp].yseq;
+        hyp.yseq.push_back(candidates[c].token);
+        hyp.score = candidates[c].score + penalty;
+        if (candidates[c].token == eos)
+          ended.push_back(hyp);
+        else if (i == maxlen - 1) {
+          hyp.yseq.push_back(eos);
+          ended.push_back(hyp);
+        }
+        else
+          next.push_back(hyp);
+      }
+      running.swap(next);
+      if ((int)ended.size() >= beam)
+        break;
+    }
+
+    const std::vector<Hypothesis>& pool = ended.empty() ? running : ended;
+    if (pool.empty())
+      return {};
+    auto best = std::max_element(pool.begin(), pool.end(),
+      [](const Hypothesis& a, const Hypothesis& b) { return a.score < b.score; });
+    std::vector<int> tokens(best->yseq.begin() + 1, best->yseq.end());
+    if (!tokens.empty() && tokens.back() == eos)
+      tokens.pop_back();
+    return tokens;
+  }
+
+  int64_t decoderCalls() const { return calls; }
+
+private:
+  void step(const std::vector<int>& yseq, const float* memory, int frames, int odim,
+    Shape& shape, const float*& prob, const int*& index) {
+    int64_t begin = nowNs();
+    decoder.setInput("words", (const float*)yseq.data(), Shape{ (int)yseq.size() });
+    decoder.setInput("encoder", memory, Shape{ frames, odim });
+    decoder.run();
+    prob = decoder.outputData("prob", shape);
+    index = (const int*)decoder.outputData("index", shape);
+    calls++;
+    if (metrics.metrics) {
+      metrics.metrics->record(metrics.step, nowNs() - begin);
+      metrics.metrics->add(metrics.steps);
+    }
+  }
+
+  CpuExecutor& decoder;
+  int sos;
+  int eos;
+  int beam;
+  float penalty;
+  SearchMetrics metrics;
+  int64_t calls = 0;
+};
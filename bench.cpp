@@ -0,0 +1,742 @@
+
+#include <map>
+#include <set>
+#include <cmath>
+#include <thread>
+#include <memory>
+#include <string>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+#include "numa.h"
+#include "ir_passes.h"
+#include "ir_builder.h"
+#include "thread_pool.h"
+#include "metrics.h"
+#include "pipeline.h"
+#include "segmenter.h"
+#include "beam_search.h"
+#include "speculative.h"
+#include "cpu_executor.h"
+#include "weight_cache.h"
+#include "corpus_decoder.h"
+
+// CPU backend micro benchmarks, one subcommand per component:
+//   bench passes [options]
+//   bench segment [options]
+//   bench subsampling [options]
+//   bench dedup [options]
+//   bench decode [options]
+//   bench draft [options]
+//   bench numa [options]
+//   bench metrics [options]
+// Every benchmark runs on random weights and checks its optimized path
+// against the reference before timing it.
+
+// best of repeat runs, in seconds
+template <typename F>
+double timeBest(int repeat, const F& fn) {
+  double best = 1e30;
+  for (int i = 0; i < repeat; ++i) {
+    int64_t begin = nowNs();
+    fn();
+    best = std::min(best, (nowNs() - begin) / 1e9);
+  }
+  return best;
+}
+
+float maxAbsDiff(const HostTensor& a, const HostTensor& b) {
+  if (a.data.size() != b.data.size())
+    return INFINITY;
+  float diff = 0.f;
+  for (size_t i = 0; i < a.data.size(); ++i)
+    diff = std::max(diff, std::fabs(a.data[i] - b.data[i]));
+  return diff;
+}
+
+// IR passes: unoptimized against optimized encoder and decoder on random
+// weights, for every concat_after / normalize_before combination
+int benchPasses(std::map<std::string, std::string>& configure) {
+  bool pass = true;
+  for (std::string concat_after : { "false", "true" })
+    for (std::string normalize_before : { "false", "true" }) {
+      configure["--concat_after"] = concat_after;
+      configure["--normalize_before"] = normalize_before;
+      ModelConfig cfg = parseConfig(configure);
+      std::cout << "[BENCH] passes concat_after " << concat_after << " normalize_before "
+        << normalize_before << std::endl;
+      RandomWeightLoader loader(5);
+      pass = verifyPasses(cfg, loader) && pass;
+    }
+  std::cout << "[BENCH] passes " << (pass ? "PASSED" : "FAILED") << std::endl;
+  return pass ? 0 : 1;
+}
+
+// segments cover [0, total) in order, every one but a short tail within
+// min_frames .. max_frames
+bool checkSegments(const std::vector<Segment>& segments, int total, int max_frames, int min_frames,
+  bool short_tail) {
+  int start = 0;
+  for (size_t i = 0; i < segments.size(); ++i) {
+    int frames = segments[i].end - segments[i].begin;
+    bool tail = short_tail && i + 1 == segments.size();
+    if (segments[i].begin != start || frames < (tail ? 1 : min_frames) || frames > max_frames)
+      return false;
+    start = segments[i].end;
+  }
+  return start == total;
+}
+
+// Segmentation of a long synthetic recording: words of 40 .. 120 frames
+// separated by 30 .. 60 frame pauses. Every cut has to land in a pause, so
+// no word is split, and the stitched per segment words have to give back
+// the whole recording. The degenerate max_frames cases have to terminate
+// with the bounds clamped.
+int benchSegment(std::map<std::string, std::string>& configure) {
+  int idim = std::stoi(configure["--idim"]);
+  const int total = 30000, max_frames = 1000, min_frames = 7;
+  RandomWeightLoader random(17);
+  std::vector<int> word(total, -1); // word index of every frame, -1 in pauses
+  int words = 0;
+  for (int t = 40; t < total;) {
+    int len = std::min(40 + (int)((random.next() + 1.f) * 40), total - t);
+    for (int i = 0; i < len; ++i)
+      word[t + i] = words;
+    ++words;
+    t += len + 30 + (int)((random.next() + 1.f) * 15);
+  }
+  std::vector<float> feats((size_t)total * idim);
+  for (int t = 0; t < total; ++t)
+    for (int f = 0; f < idim; ++f)
+      feats[(size_t)t * idim + f] = (word[t] >= 0 ? 1.f : -1.f) + 0.2f * random.next();
+  MatrixView view;
+  view.data = (const char*)feats.data();
+  view.rows = total;
+  view.cols = idim;
+
+  std::vector<Segment> segments;
+  double time = timeBest(1, [&] { segments = segmentByActivity(frameEnergy(view), max_frames, min_frames); });
+  std::vector<Segment> again = segmentByActivity(frameEnergy(view), max_frames, min_frames);
+  bool same = again.size() == segments.size();
+  for (size_t i = 0; same && i < again.size(); ++i)
+    same = again[i].begin == segments[i].begin && again[i].end == segments[i].end;
+  bool bounds = checkSegments(segments, total, max_frames, min_frames, false);
+  bool pauses = true;
+  for (size_t i = 0; i + 1 < segments.size(); ++i)
+    pauses = pauses && word[segments[i].end] < 0 && word[segments[i].end - 1] < 0;
+
+  // per segment words, filled last segment first as an out of order writer would
+  std::vector<std::vector<int>> tokens(segments.size());
+  for (int i = (int)segments.size() - 1; i >= 0; --i)
+    for (int t = segments[i].begin; t < segments[i].end; ++t)
+      if (word[t] >= 0 && (t == segments[i].begin || word[t - 1] != word[t]))
+        tokens[i].push_back(word[t]);
+  std::vector<int> stitched = stitchSegments(tokens), expected(words);
+  for (int w = 0; w < words; ++w)
+    expected[w] = w;
+  bool stitch = stitched == expected;
+
+  std::cout << "[BENCH] segment " << total << " frames, " << words << " words, max_frames "
+    << max_frames << ": " << segments.size() << " segments in " << time * 1e3 << " ms" << std::endl;
+  std::cout << "[BENCH] segment cuts in pauses " << (pauses ? "yes" : "no") << ", bounds "
+    << (bounds ? "yes" : "no") << ", same cuts twice " << (same ? "yes" : "no") << ", stitched words "
+    << (stitch ? "yes" : "no") << std::endl;
+  bool pass = pauses && bounds && same && stitch;
+
+  // max_frames below 2 * min_frames: min_frames wins, only the tail may be short
+  std::vector<float> flat(1001, 1.f);
+  segments = segmentByActivity(flat, 1000, 600);
+  bool degenerate = segments.size() == 2 && segments[0].end == 600 &&
+    checkSegments(segments, 1001, 1000, 600, true);
+  for (int max : { 13, 8, 7, 1, 0, -5 }) {
+    segments = segmentByActivity(std::vector<float>(100, 1.f), max, min_frames);
+    degenerate = degenerate && checkSegments(segments, 100, std::max(max, min_frames), min_frames, max < 2 * min_frames);
+  }
+  std::cout << "[BENCH] segment degenerate max_frames " << (degenerate ? "yes" : "no") << std::endl;
+  pass = pass && degenerate;
+  std::cout << "[BENCH] segment " << (pass ? "PASSED" : "FAILED") << std::endl;
+  return pass ? 0 : 1;
+}
+
+// Conv2dSubsampling: the reference Conv2d / Relu / ToSequence kernels against
+// the fused tile kernel on 1 .. --threads threads
+int benchSubsampling(std::map<std::string, std::string>& configure) {
+  ModelConfig cfg = parseConfig(configure);
+  int frames = std::stoi(configure["--frames"]);
+  int threads = std::max(1, std::stoi(configure["--threads"]));
+  int repeat = std::max(1, std::stoi(configure["--repeat"]));
+
+  RandomWeightLoader loader(3);
+  IRBuilder builder(cfg, loader);
+  Graph reference = builder.BuildSubsampling();
+  Graph fused = reference;
+  runPasses(fused, PassOptions());
+
+  HostTensor data;
+  data.shape = Shape{ 1, 1, cfg.idim, frames };
+  data.data.resize(data.shape.count());
+  RandomWeightLoader random(11);
+  for (auto& v : data.data)
+    v = random.next();
+  std::map<std::string, Shape> shapes{ { "data", data.shape } };
+  int out_frames = ((frames - 1) / 2 - 1) / 2;
+
+  CpuExecutor ref(reference, shapes);
+  double ref_time = timeBest(repeat, [&] { ref.run({ { "data", data } }); });
+  HostTensor expected = ref.output("embed");
+  std::cout << "[BENCH] subsampling idim " << cfg.idim << " odim " << cfg.odim << " frames "
+    << frames << " -> " << out_frames << std::endl;
+  std::cout << "[BENCH] reference: " << ref_time * 1e3 << " ms, "
+    << out_frames / ref_time << " frames/s" << std::endl;
+
+  bool pass = true;
+  double single = 0.0;
+  for (int n = 1; n <= threads; n *= 2) {
+    ParallelFor parallel(n);
+    CpuExecutor opt(fused, shapes, &parallel);
+    double time = timeBest(repeat, [&] { opt.run({ { "data", data } }); });
+    float diff = maxAbsDiff(expected, opt.output("embed"));
+    if (n == 1)
+      single = time;
+    std::cout << "[BENCH] fused " << n << " threads: " << time * 1e3 << " ms, "
+      << out_frames / time << " frames/s, " << ref_time / time << "x reference, "
+      << single / time << "x single thread, max abs diff " << diff << std::endl;
+    pass = pass && diff <= 1e-3f;
+    if (n < threads && n * 2 > threads)
+      n = threads / 2;
+  }
+  std::cout << "[BENCH] subsampling " << (pass ? "PASSED" : "FAILED") << std::endl;
+  return pass ? 0 : 1;
+}
+
+void makeDirectory(const std::string& path) {
+#ifdef _WIN32
+  _mkdir(path.c_str());
+#else
+  mkdir(path.c_str(), 0755);
+#endif
+}
+
+// Records the weight files a graph reads instead of reading them.
+class ListingWeightLoader : public WeightLoader {
+public:
+  Weight load(const std::string& file, int64_t count) override {
+    files.push_back({ file, count });
+    return makeWeight(std::vector<float>(count));
+  }
+
+  std::vector<std::pair<std::string, int64_t>> files;
+};
+
+// random weights for every file the encoder and decoders read, keyed by the
+// file name below the model path
+std::map<std::string, std::vector<float>> randomModel(ModelConfig cfg, RandomWeightLoader& random) {
+  ListingWeightLoader listing;
+  cfg.path = "";
+  IRBuilder(cfg, listing).BuildEncoder();
+  IRBuilder(cfg, listing).BuildDecoder();
+  IRBuilder(cfg, listing).BuildDecoder(true);
+  std::map<std::string, std::vector<float>> files;
+  for (auto& file : listing.files) {
+    std::vector<float>& data = files[file.first];
+    data.resize(file.second);
+    for (auto& v : data)
+      v = random.next() * 0.1f;
+  }
+  return files;
+}
+
+// Writes --models synthetic fine tuned variants of one base model below
+// --dir: the conv front end, pe tables and encoder are the frozen base, the
+// decoder and ctc layers are tuned per variant. All of them are loaded into
+// one WeightCache, each is checked against a private load of its directory.
+int benchDedup(std::map<std::string, std::string>& configure) {
+  ModelConfig cfg = parseConfig(configure);
+  int models = std::max(1, std::stoi(configure["--models"]));
+  std::string dir = configure["--dir"];
+  makeDirectory(dir);
+
+  RandomWeightLoader random(5);
+  std::map<std::string, std::vector<float>> base = randomModel(cfg, random);
+  for (int m = 0; m < models; ++m) {
+    std::string path = dir + "/model" + std::to_string(m);
+    makeDirectory(path);
+    for (auto& kv : base) {
+      std::vector<float> data = kv.second;
+      bool tuned = (kv.first.find("/decoder.") == 0 || kv.first.find("/ctc.") == 0) &&
+        kv.first.find(".pe") == std::string::npos;
+      if (tuned && m > 0)
+        for (auto& v : data)
+          v += random.next() * 0.01f;
+      std::ofstream ofs(path + kv.first, std::ios::binary);
+      ofs.write((const char*)data.data(), data.size() * sizeof(float));
+    }
+  }
+
+  WeightCache cache;
+  std::vector<Graph> encoders, decoders;
+  for (int m = 0; m < models; ++m) {
+    cfg.path = dir + "/model" + std::to_string(m);
+    SharedWeightLoader loader(cache);
+    IRBuilder builder(cfg, loader);
+    PassOptions options;
+    options.loader = &loader;
+    encoders.push_back(builder.BuildEncoder());
+    runPasses(encoders.back(), options);
+    decoders.push_back(builder.BuildDecoder());
+    runPasses(decoders.back(), options);
+  }
+
+  HostTensor data;
+  data.shape = Shape{ 1, 1, cfg.idim, 200 };
+  data.data.resize(data.shape.count());
+  for (auto& v : data.data)
+    v = random.next();
+  std::vector<int> ids{ cfg.nvocab - 1, 1, 2, 3 };
+  bool pass = true;
+  for (int m = 0; m < models; ++m) {
+    cfg.path = dir + "/model" + std::to_string(m);
+    FileWeightLoader loader;
+    IRBuilder builder(cfg, loader);
+    Graph encoder = builder.BuildEncoder();
+    Graph decoder = builder.BuildDecoder();
+    runPasses(encoder, PassOptions());
+    runPasses(decoder, PassOptions());
+    pass = checkEquivalence(encoder, encoders[m], { { "data", data } }, 0.f) && pass;
+    CpuExecutor run(encoder, { { "data", data.shape } });
+    run.run({ { "data", data } });
+    pass = checkEquivalence(decoder, decoders[m], {
+      { "words", makeIntTensor(Shape{ (int)ids.size() }, ids) },
+      { "encoder", run.output("encoder") } }, 0.f) && pass;
+  }
+
+  std::map<std::string, std::vector<const Graph*>> usage;
+  for (int m = 0; m < models; ++m)
+    usage["model" + std::to_string(m)] = { &encoders[m], &decoders[m] };
+  logWeightUsage(usage);
+  std::cout << "[WEIGHTS] " << cache.deduplicatedTensors() << " tensors deduplicated" << std::endl;
+  std::cout << "[BENCH] dedup " << (pass ? "PASSED" : "FAILED") << std::endl;
+  return pass ? 0 : 1;
+}
+
+// Kaldi binary float matrix entries "key \0BFM <rows> <cols> data" and the
+// scp lines pointing at them
+void writeArk(const std::string& ark, const std::string& scp,
+  const std::vector<std::pair<std::string, std::vector<float>>>& utts, int dim) {
+  std::ofstream afs(ark, std::ios::binary), sfs(scp);
+  for (auto& utt : utts) {
+    int32_t rows = (int32_t)(utt.second.size() / dim), cols = dim;
+    afs << utt.first << " ";
+    sfs << utt.first << " " << ark << ":" << (size_t)afs.tellp() << "\n";
+    afs.write("\0BFM \4", 6);
+    afs.write((const char*)&rows, 4);
+    afs.write("\4", 1);
+    afs.write((const char*)&cols, 4);
+    afs.write((const char*)utt.second.data(), utt.second.size() * sizeof(float));
+  }
+}
+
+// transcript lines of a decode output by key, count of lines per key
+std::map<std::string, std::pair<std::string, int>> readTranscripts(const std::string& file) {
+  std::map<std::string, std::pair<std::string, int>> lines;
+  std::ifstream ifs(file);
+  std::string line;
+  while (std::getline(ifs, line)) {
+    auto& entry = lines[line.substr(0, line.find(' '))];
+    entry.first = line;
+    entry.second++;
+  }
+  return lines;
+}
+
+// The offline decode pipeline end to end on a synthetic corpus below --dir:
+// a random weight model and --utts utterances of 20 .. 400 frames, one too
+// short for the encoder and one longer than --max_frames 300. The corpus is
+// decoded with 1 and with max(2, --threads) pool threads through a two slot
+// pipeline; every utterance but the short one has to be written exactly once
+// (the long one segmented) and the transcripts of both runs have to match.
+int benchDecode(std::map<std::string, std::string>& configure) {
+  ModelConfig cfg = parseConfig(configure);
+  int nutts = std::max(1, std::stoi(configure["--utts"]));
+  int threads = std::max(2, std::stoi(configure["--threads"]));
+  std::string dir = configure["--dir"];
+  makeDirectory(dir);
+  std::string path = dir + "/decode_model";
+  makeDirectory(path);
+  RandomWeightLoader random(23);
+  for (auto& kv : randomModel(cfg, random)) {
+    std::ofstream ofs(path + kv.first, std::ios::binary);
+    ofs.write((const char*)kv.second.data(), kv.second.size() * sizeof(float));
+  }
+
+  std::vector<std::pair<std::string, std::vector<float>>> utts;
+  std::set<std::string> expected;
+  for (int i = 0; i < nutts + 2; ++i) {
+    int frames = i == nutts ? 5 : i == nutts + 1 ? 700 : 20 + (int)((random.next() + 1.f) * 190);
+    std::string key = "utt" + std::to_string(1000 + i);
+    utts.push_back({ key, std::vector<float>((size_t)frames * cfg.idim) });
+    for (auto& v : utts.back().second)
+      v = random.next();
+    if (frames >= 7)
+      expected.insert(key);
+  }
+  writeArk(dir + "/feats.ark", dir + "/feats.scp", utts, cfg.idim);
+
+  std::map<std::string, std::pair<std::string, int>> outputs[2];
+  double wall[2];
+  for (int run = 0; run < 2; ++run) {
+    std::map<std::string, std::string> options = decodeOptions();
+    for (auto& kv : configure)
+      if (options.count(kv.first))
+        options[kv.first] = kv.second;
+    options["--feats"] = dir + "/feats.scp";
+    options["--output"] = dir + "/decode" + std::to_string(run) + ".txt";
+    options["--path"] = path;
+    options["--nj"] = std::to_string(run == 0 ? 1 : threads);
+    options["--inflight"] = "2";
+    options["--beam"] = "3";
+    options["--maxlenratio"] = "0.2";
+    options["--max_frames"] = "300";
+    int64_t begin = nowNs();
+    decodeCorpus(options);
+    wall[run] = (nowNs() - begin) / 1e9;
+    outputs[run] = readTranscripts(options["--output"]);
+  }
+
+  bool once = outputs[1].size() == expected.size(), same = outputs[0].size() == outputs[1].size();
+  for (auto& kv : outputs[1]) {
+    once = once && expected.count(kv.first) && kv.second.second == 1;
+    auto it = outputs[0].find(kv.first);
+    same = same && it != outputs[0].end() && it->second.first == kv.second.first;
+  }
+  std::cout << "[BENCH] decode " << utts.size() << " utterances, 1 thread: " << wall[0] << " s, "
+    << threads << " threads: " << wall[1] << " s" << std::endl;
+  std::cout << "[BENCH] decode written once " << (once ? "yes" : "no") << ", short one skipped "
+    << (outputs[1].count(utts[nutts].first) ? "no" : "yes") << ", same transcripts "
+    << (same ? "yes" : "no") << std::endl;
+  bool pass = once && same;
+  std::cout << "[BENCH] decode " << (pass ? "PASSED" : "FAILED") << std::endl;
+  return pass ? 0 : 1;
+}
+
+// RandomWeightLoader with LayerNorm gains near 1 instead of near 0, else the
+// random decoder predicts the same token at every position
+class DraftWeightLoader : public RandomWeightLoader {
+public:
+  DraftWeightLoader(uint32_t seed) : RandomWeightLoader(seed) {}
+
+  Weight load(const std::string& file, int64_t count) override {
+    Weight weight = RandomWeightLoader::load(file, count);
+    if (file.find("norm") == std::string::npos || file.find(".weight") == std::string::npos)
+      return weight;
+    std::vector<float> gain(weight.values, weight.values + count);
+    for (auto& v : gain)
+      v += 1.f;
+    return makeWeight(std::move(gain));
+  }
+};
+
+// log_ctc_prob [frames, nvocab] whose best path is draft: every token held
+// for two frames (a repeat to merge) and followed by a blank, blanks to the end
+std::vector<float> ctcForDraft(const std::vector<int>& draft, int frames, int nvocab) {
+  std::vector<int> path{ 0 };
+  for (int token : draft)
+    path.insert(path.end(), { token, token, 0 });
+  path.resize(std::max((int)path.size(), frames), 0);
+  std::vector<float> logp((size_t)frames * nvocab, std::log(0.1f / (nvocab - 1)));
+  for (int t = 0; t < frames; ++t)
+    logp[(size_t)t * nvocab + path[t]] = std::log(0.9f);
+  return logp;
+}
+
+// CTC draft speculative decoding against plain beam search on a random
+// weight decoder. The reference is the greedy (beam 1) chain of the step
+// decoder; drafts are built from it by hand so the accept counts are known:
+//   full:    the longest chain prefix followed by a token new to it, as eos
+//   partial: the chain with its 4th token replaced, 3 tokens accepted
+//   wrong:   a wrong first token, nothing accepted
+// A resume from the agreed prefix has to give the plain beam 1 result.
+// Beam --beam (default 4) on the full draft is compared as well, reported
+// only: a wider beam may leave the greedy chain.
+int benchDraft(std::map<std::string, std::string>& configure) {
+  ModelConfig cfg = parseConfig(configure);
+  int beam = std::max(1, std::stoi(configure["--beam"]));
+  const int frames = 40, maxlen = 12, sos = cfg.nvocab - 1;
+  // one loader per graph, random weights differ with every load
+  DraftWeightLoader loader(9), loader_full(9);
+  Graph decoder = IRBuilder(cfg, loader).BuildDecoder();
+  Graph decoder_full = IRBuilder(cfg, loader_full).BuildDecoder(true);
+  runPasses(decoder, PassOptions());
+  runPasses(decoder_full, PassOptions());
+  std::map<std::string, Shape> shapes{
+    { "words", Shape{ maxlen + 1 } }, { "encoder", Shape{ frames, cfg.odim } } };
+  CpuExecutor step(decoder, shapes), full(decoder_full, shapes);
+  std::vector<float> memory((size_t)frames * cfg.odim);
+  RandomWeightLoader random(3);
+  for (auto& v : memory)
+    v = random.next();
+
+  // the blank / repeat collapse of the best path
+  std::vector<float> logp = ctcForDraft({ 5, 5, 7 }, frames, cfg.nvocab);
+  bool collapse = ctcGreedy(logp.data(), frames, cfg.nvocab) == std::vector<int>{ 5, 5, 7 };
+
+  // eos -1 never ends a hypothesis, the chain runs to maxlen
+  std::vector<int> chain = BeamSearch(step, sos, -1, 1, 0.f).search(memory.data(), frames, cfg.odim, maxlen);
+  // the longest prefix whose next token is new to it, that token becomes eos
+  int k = (int)chain.size() - 1;
+  while (k > 0 && std::find(chain.begin(), chain.begin() + k, chain[k]) != chain.begin() + k)
+    --k;
+  bool pass = collapse && (int)chain.size() == maxlen && k > 0;
+  std::cout << "[BENCH] draft greedy chain of " << chain.size() << " tokens, eos after "
+    << k << ", ctc collapse " << (collapse ? "yes" : "no") << std::endl;
+  if (!pass) {
+    std::cout << "[BENCH] draft FAILED" << std::endl;
+    return 1;
+  }
+
+  auto run = [&](const std::string& name, std::vector<int> draft, int eos, int expect_accept,
+    bool expect_full, int width) {
+    int64_t begin = nowNs();
+    BeamSearch plain(step, sos, eos, width, 0.f);
+    std::vector<int> reference = plain.search(memory.data(), frames, cfg.odim, maxlen);
+    double plain_ms = (nowNs() - begin) / 1e6;
+    begin = nowNs();
+    BeamSearch resume(step, sos, eos, width, 0.f);
+    CtcDraftDecoder spec(full, resume, sos, eos);
+    DraftStats stats;
+    logp = ctcForDraft(draft, frames, cfg.nvocab);
+    std::vector<int> tokens = spec.decode(memory.data(), logp.data(), frames, cfg.odim,
+      cfg.nvocab, maxlen, stats);
+    double draft_ms = (nowNs() - begin) / 1e6;
+    bool same = tokens == reference;
+    bool counts = expect_accept < 0 || (stats.accepted == expect_accept && (stats.full_accepts == 1) == expect_full);
+    std::cout << "[BENCH] draft " << name << " beam " << width << ": " << stats.accepted << "/"
+      << stats.drafted << " accepted, " << (stats.full_accepts ? "full" : "resumed") << ", "
+      << stats.decoder_calls << " decoder calls against " << plain.decoderCalls() << ", "
+      << draft_ms << " ms against " << plain_ms << " ms, same tokens " << (same ? "yes" : "no") << std::endl;
+    return width == 1 ? same && counts : counts;
+  };
+
+  std::vector<int> head(chain.begin(), chain.begin() + k);
+  std::vector<int> partial(chain.begin(), chain.begin() + 6);
+  partial[3] = (partial[3] + 1) % sos;
+  std::vector<int> wrong(chain.begin(), chain.begin() + 3);
+  wrong[0] = (wrong[0] + 1) % sos;
+  pass = run("full", head, chain[k], k, true, 1) && pass;
+  pass = run("partial", partial, -1, 3, false, 1) && pass;
+  pass = run("wrong", wrong, -1, 0, false, 1) && pass;
+  run("full", head, chain[k], -1, false, beam);
+  std::cout << "[BENCH] draft " << (pass ? "PASSED" : "FAILED") << std::endl;
+  return pass ? 0 : 1;
+}
+
+// Encoder throughput on 1 .. all nodes with 1 .. all cpus of each node. Every
+// run is done twice: workers reading the replica of their own node, and all
+// of them reading node 0's weights, the gap is the cost of remote memory.
+int benchNuma(std::map<std::string, std::string>& configure) {
+  ModelConfig cfg = parseConfig(configure);
+  int frames = std::stoi(configure["--frames"]);
+  int utts = std::max(1, std::stoi(configure["--utts"]));
+  std::vector<NumaNode> topology = numaTopology();
+  if (std::stoi(configure["--numa_nodes"]) > 0)
+    topology = splitTopology(topology, std::stoi(configure["--numa_nodes"]));
+  logTopology(topology);
+
+  RandomWeightLoader loader(3);
+  Graph encoder = IRBuilder(cfg, loader).BuildEncoder();
+  runPasses(encoder, PassOptions());
+  std::vector<Graph> replicas;
+  for (auto& node : topology)
+    replicas.push_back(replicateWeights(encoder, node));
+
+  HostTensor data;
+  data.shape = Shape{ 1, 1, cfg.idim, frames };
+  data.data.resize(data.shape.count());
+  RandomWeightLoader random(11);
+  for (auto& v : data.data)
+    v = random.next();
+
+  size_t max_cpus = 0;
+  for (auto& node : topology)
+    max_cpus = std::max(max_cpus, node.cpus.size());
+  double base = 0.0;
+  for (int nodes = 1; nodes <= (int)topology.size(); ++nodes) {
+    std::vector<NumaNode> used(topology.begin(), topology.begin() + nodes);
+    for (int per_node = 1; per_node <= (int)max_cpus; per_node *= 2) {
+      for (int local = 1; local >= 0; --local) {
+        if (!local && nodes == 1)
+          continue;
+        ThreadPool pool(used, nodes * per_node);
+        std::vector<std::unique_ptr<CpuExecutor>> executors;
+        for (int i = 0; i < pool.size(); ++i)
+          executors.emplace_back(new CpuExecutor(replicas[local ? pool.workerNode(i) : 0], { { "data", data.shape } }));
+        // untimed round, arenas are allocated by the first run on their worker
+        for (int i = 0; i < pool.size(); ++i)
+          pool.submit([&] { executors[ThreadPool::currentWorker()]->run({ { "data", data } }); }, pool.workerNode(i));
+        pool.wait();
+
+        int64_t begin = nowNs();
+        for (int u = 0; u < utts; ++u)
+          pool.submit([&] { executors[ThreadPool::currentWorker()]->run({ { "data", data } }); }, u % nodes);
+        pool.wait();
+        double seconds = (nowNs() - begin) / 1e9;
+        if (base == 0.0)
+          base = seconds;
+        std::cout << "[BENCH] " << nodes << " nodes x " << per_node << " threads, "
+          << (local ? "local" : "node 0") << " weights: " << utts / seconds << " utts/s, "
+          << (double)utts * frames / seconds << " frames/s, " << base / seconds << "x, "
+          << pool.remoteSteals() << " remote steals" << std::endl;
+      }
+      if (per_node < (int)max_cpus && per_node * 2 > (int)max_cpus)
+        per_node = (int)max_cpus / 2;
+    }
+  }
+  return 0;
+}
+
+// Cost of the pipeline metrics on the recording threads: a histogram record,
+// a counter add and the clock read that goes with a latency, single threaded
+// and with every thread recording at once, plus the cost of a snapshot.
+int benchMetrics(std::map<std::string, std::string>& configure) {
+  int64_t iterations = std::stoll(configure["--iterations"]);
+  int threads = std::max(1, std::stoi(configure["--threads"]));
+  Metrics metrics;
+  int latency = metrics.histogram("latency");
+  int count = metrics.counter("count");
+
+  // values spread over many buckets, as real latencies are
+  std::vector<int64_t> values(4096);
+  RandomWeightLoader random(13);
+  for (auto& v : values)
+    v = (int64_t)std::exp(10.0 + 5.0 * random.next());
+
+  double clock = timeBest(3, [&] {
+    int64_t sum = 0;
+    for (int64_t i = 0; i < iterations; ++i)
+      sum += nowNs();
+    if (sum == 42)
+      std::cout << std::endl;
+  }) / iterations;
+  double record = timeBest(3, [&] {
+    for (int64_t i = 0; i < iterations; ++i)
+      metrics.record(latency, values[i & 4095]);
+  }) / iterations;
+  double add = timeBest(3, [&] {
+    for (int64_t i = 0; i < iterations; ++i)
+      metrics.add(count);
+  }) / iterations;
+
+  double parallel = timeBest(1, [&] {
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t)
+      workers.emplace_back([&] {
+        for (int64_t i = 0; i < iterations; ++i)
+          metrics.record(latency, values[i & 4095]);
+      });
+    for (auto& w : workers)
+      w.join();
+  }) / iterations;
+
+  MetricsSnapshot snap;
+  double snapshot = timeBest(3, [&] { snap = metrics.snapshot(); });
+  uint64_t expected = (uint64_t)iterations * (3 + threads);
+  bool pass = snap.histograms[0].count == expected && snap.counters[0].second == (uint64_t)iterations * 3;
+
+  std::cout << "[BENCH] metrics clock read: " << clock * 1e9 << " ns" << std::endl;
+  std::cout << "[BENCH] metrics histogram record: " << record * 1e9 << " ns, counter add: "
+    << add * 1e9 << " ns" << std::endl;
+  std::cout << "[BENCH] metrics " << threads << " threads recording: " << parallel * 1e9
+    << " ns wall per round of one record on each thread" << std::endl;
+  std::cout << "[BENCH] metrics snapshot: " << snapshot * 1e6 << " us, p50 "
+    << snap.histograms[0].percentile(50) << " ns, p99 " << snap.histograms[0].percentile(99)
+    << " ns of " << snap.histograms[0].count << " records" << std::endl;
+  std::cout << "[BENCH] metrics " << (pass ? "PASSED" : "FAILED") << std::endl;
+  return pass ? 0 : 1;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    std::cout
+      << "bench passes [optimized against unoptimized graphs for every layer variant]" << std::endl
+      << "bench segment [cuts and stitching of a long synthetic recording]" << std::endl
+      << "bench subsampling [conv front end kernels against the reference]" << std::endl
+      << "bench dedup [weight sharing between synthetic fine tuned models]" << std::endl
+      << "bench decode [the offline decode pipeline on a synthetic corpus, 1 against --threads threads]" << std::endl
+      << "bench draft [CTC draft speculative decoding against beam search, known accept counts]" << std::endl
+      << "bench numa [encoder scaling per NUMA node with local and remote weights]" << std::endl
+      << "bench metrics [overhead of the pipeline latency histograms and counters]" << std::endl
+      << "--frames [input frames, default 3000]" << std::endl
+      << "--threads [max threads, tried in powers of two, default hardware concurrency]" << std::endl
+      << "--repeat [timed runs, the best is reported, default 5]" << std::endl
+      << "--models [synthetic model variants for dedup, default 3]" << std::endl
+      << "--dir [where dedup and decode write models and features, default bench_models]" << std::endl
+      << "--utts [utterances per numa run and decode corpus, default 64]" << std::endl
+      << "--iterations [records per metrics measurement, default 10000000]" << std::endl
+      << "--beam [beam size of the draft comparison, default 4]" << std::endl
+      << "--numa_nodes [split the cpus into this many logical nodes instead of the detected ones, default 0]" << std::endl
+      << "--idim [input feature dimension, default 83]" << std::endl
+      << "--odim [feature dimension, default 256]" << std::endl;
+    return 0;
+  }
+  std::map<std::string, std::string> configure{
+    {"--frames","3000"},
+    {"--threads",std::to_string(std::max(1u, std::thread::hardware_concurrency()))},
+    {"--repeat","5"},
+    {"--models","3"},
+    {"--dir","bench_models"},
+    {"--utts","64"},
+    {"--iterations","10000000"},
+    {"--numa_nodes","0"},
+    {"--beam","4"},
+    {"--path","bench"},
+    {"--idim","83"},
+    {"--n_Head","4"},
+    {"--odim","256"},
+    {"--feed_forward","2048"},
+    {"--nvocab","7244"},
+    {"--dtype","float"},
+    {"--concat_after","false"},
+    {"--normalize_before","true"},
+    {"--encoder_layers","12"},
+    {"--decoder_layers","6"},
+    {"--batchsize","1"},
+    {"--topk","16"},
+    {"--maxseql","5000"},
+    {"--model_name","bench"}
+  };
+
+  std::string command = argv[1];
+  for (int i = 2; i + 1 < argc; i += 2) {
+    if (configure.count(argv[i]) > 0) {
+      configure[argv[i]] = argv[i + 1];
+    }
+    else {
+      std::cerr << "Option is not supported!" << std::endl;
+      exit(0);
+    }
+  }
+
+  if (command == "passes")
+    return benchPasses(configure);
+  if (command == "segment")
+    return benchSegment(configure);
+  if (command == "subsampling")
+    return benchSubsampling(configure);
+  if (command == "dedup")
+    return benchDedup(configure);
+  if (command == "decode")
+    return benchDecode(configure);
+  if (command == "draft")
+    return benchDraft(configure);
+  if (command == "numa")
+    return benchNuma(configure);
+  if (command == "metrics")
+    return benchMetrics(configure);
+  std::cerr << "unknown benchmark " << command << std::endl;
+  return 1;
+}
@@ -0,0 +1,438 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <thread>
+#include <memory>
+#include <fstream>
+#include <algorithm>
+#include "numa.h"
+#include "kaldi_io.h"
+#include "metrics.h"
+#include "pipeline.h"
+#include "segmenter.h"
+#include "ir_passes.h"
+#include "ir_builder.h"
+#include "thread_pool.h"
+#include "beam_search.h"
+#include "speculative.h"
+#include "cpu_executor.h"
+#include "weight_cache.h"
+
+// Offline corpus decoding on the CPU backend:
+//   read (mmap ark) -> encode -> beam search -> write
+// Reading and writing run on their own threads, encode and search are tasks
+// of a work stealing pool, at most --inflight segments are in the pipeline.
+// Recordings longer than --max_frames are cut into segments that are encoded
+// and searched in parallel, the writer stitches them back in order. With
+// --numa the workers are pinned per node, every node has its own copy of the
+// weights and segments are dealt round robin to the nodes. --metrics keeps a
+// text snapshot of per stage latency histograms and counters up to date.
+
+struct Recording {
+  std::string key;
+  std::vector<Segment> segments;
+  std::vector<std::vector<int>> tokens; // per segment, filled by the writer
+  int done = 0;
+  int64_t begin_ns = 0;
+};
+
+struct DecodeJob {
+  std::shared_ptr<Recording> rec;
+  int segment = 0;
+  int frames = 0;
+  std::vector<float> feats;  // [idim, T], the encoder input layout
+  std::vector<float> memory; // [T', odim]
+  std::vector<float> ctc;    // [T', nvocab], only for --ctc_draft
+  int enc_frames = 0;
+  std::vector<int> tokens;
+  int64_t queued_ns = 0; // when it was handed to the next stage
+};
+
+// ESPnet units file: "token id" per line, id 0 is <blank>
+std::vector<std::string> readDict(const std::string& file, int nvocab) {
+  std::vector<std::string> dict(nvocab);
+  for (int i = 0; i < nvocab; ++i)
+    dict[i] = std::to_string(i);
+  if (file.empty())
+    return dict;
+  std::ifstream ifs(file);
+  if (ifs.fail()) {
+    std::cout << file << " open fail!" << std::endl;
+    exit(0);
+  }
+  std::string token;
+  int id;
+  while (ifs >> token >> id)
+    if (id >= 0 && id < nvocab)
+      dict[id] = token;
+  return dict;
+}
+
+// decode options and their defaults
+std::map<std::string, std::string> decodeOptions() {
+  return {
+    {"--feats",""},
+    {"--output","decode.txt"},
+    {"--dict",""},
+    {"--beam","5"},
+    {"--penalty","0"},
+    {"--maxlenratio","0"},
+    {"--nj",std::to_string(std::max(1u, std::thread::hardware_concurrency()))},
+    {"--inflight","0"},
+    {"--ctc_draft","false"},
+    {"--numa","false"},
+    {"--numa_nodes","0"},
+    {"--metrics",""},
+    {"--metrics_interval","10"},
+    {"--max_frames","6000"},
+    {"--timestamps",""},
+    {"--frame_shift","0.01"},
+    {"--path","asr"},
+    {"--idim","83"},
+    {"--n_Head","4"},
+    {"--odim","256"},
+    {"--feed_forward","2048"},
+    {"--nvocab","7244"},
+    {"--dtype","float"},
+    {"--concat_after","false"},
+    {"--normalize_before","true"},
+    {"--encoder_layers","12"},
+    {"--decoder_layers","6"},
+    {"--batchsize","1"},
+    {"--topk","16"},
+    {"--maxseql","5000"},
+    {"--model_name","asr"}
+  };
+}
+
+// decodes configure["--feats"] into configure["--output"]
+void decodeCorpus(std::map<std::string, std::string>& configure) {
+  ModelConfig cfg = parseConfig(configure);
+  int beam = std::stoi(configure["--beam"]);
+  float penalty = std::stof(configure["--penalty"]);
+  float maxlenratio = std::stof(configure["--maxlenratio"]);
+  int nj = std::max(1, std::stoi(configure["--nj"]));
+  int inflight = std::stoi(configure["--inflight"]);
+  if (inflight <= 0)
+    inflight = 2 * nj;
+  int sos = cfg.nvocab - 1, eos = cfg.nvocab - 1;
+  bool draft = configure["--ctc_draft"] != "false";
+  bool compare = configure["--ctc_draft"] == "compare";
+  const int max_frames = std::min(std::stoi(configure["--max_frames"]), maxEncoderShapes(cfg)["data"].d[3]);
+  const int min_frames = 7;
+  if (max_frames < 2 * min_frames) {
+    std::cerr << "--max_frames " << max_frames << " is below " << 2 * min_frames
+      << ", segments would be too short for the encoder!" << std::endl;
+    exit(0);
+  }
+  double frame_shift = std::stod(configure["--frame_shift"]);
+  const int max_words = maxDecoderShapes(cfg)["words"].d[0];
+
+  // utterances sorted longest first so the tail of the run is short ones
+  std::vector<Utterance> all = readScp(configure["--feats"]), utts;
+  ArkReader ark;
+  ark.probe(all);
+  int corpus_frames = 0;
+  for (auto& utt : all) {
+    if (utt.dim != cfg.idim) {
+      std::cerr << utt.key << ": feature dimension " << utt.dim << " != idim " << cfg.idim << std::endl;
+      exit(0);
+    }
+    if (utt.frames < min_frames) {
+      std::cerr << utt.key << ": " << utt.frames << " frames are too short, skipped" << std::endl;
+      continue;
+    }
+    corpus_frames = std::max(corpus_frames, std::min(utt.frames, max_frames));
+    utts.push_back(utt);
+  }
+  std::stable_sort(utts.begin(), utts.end(),
+    [](const Utterance& a, const Utterance& b) { return a.frames > b.frames; });
+  std::cout << "decoding " << utts.size() << " utterances with " << nj << " threads" << std::endl;
+
+  // the step and all positions decoders read the same files, the cache maps
+  // them and derives their transposed / merged constants once
+  WeightCache cache;
+  SharedWeightLoader loader(cache);
+  IRBuilder builder(cfg, loader);
+  PassOptions options;
+  options.loader = &loader;
+  Graph encoder = builder.BuildEncoder();
+  Graph decoder = builder.BuildDecoder();
+  runPasses(encoder, options);
+  runPasses(decoder, options);
+  Graph decoder_full;
+  if (draft) {
+    decoder_full = builder.BuildDecoder(true);
+    runPasses(decoder_full, options);
+  }
+  logWeightUsage({ { "encoder", { &encoder } }, { "decoder", { &decoder, &decoder_full } } });
+  std::cout << "[WEIGHTS] " << cache.deduplicatedTensors() << " tensors deduplicated" << std::endl;
+
+  std::vector<NumaNode> topology{ NumaNode() };
+  if (configure["--numa"] == "true") {
+    topology = numaTopology();
+    if (std::stoi(configure["--numa_nodes"]) > 0)
+      topology = splitTopology(topology, std::stoi(configure["--numa_nodes"]));
+    logTopology(topology);
+  }
+  std::unique_ptr<ThreadPool> pool(new ThreadPool(topology, nj));
+
+  // weights replicated on every node, the single graphs otherwise. The
+  // loaded graphs are released afterwards so that with several nodes every
+  // weight lives only in node local copies
+  std::vector<Graph> encoders_r, decoders_r, decoders_full_r;
+  if (topology.size() > 1) {
+    for (auto& node : topology) {
+      std::map<const float*, Weight> copies; // the two decoders keep sharing
+      encoders_r.push_back(replicateWeights(encoder, node, copies));
+      decoders_r.push_back(replicateWeights(decoder, node, copies));
+      if (draft)
+        decoders_full_r.push_back(replicateWeights(decoder_full, node, copies));
+    }
+  }
+  else {
+    encoders_r.push_back(std::move(encoder));
+    decoders_r.push_back(std::move(decoder));
+    decoders_full_r.push_back(std::move(decoder_full));
+  }
+  encoder = decoder = decoder_full = Graph();
+
+  // the longest output of a segment with enc_frames encoder frames, the
+  // decoder input (sos + tokens, or sos + CTC draft) never exceeds it
+  auto maxLength = [&](int enc_frames) {
+    int maxlen = maxlenratio > 0 ? std::max(1, (int)(maxlenratio * enc_frames)) : enc_frames;
+    return std::min(maxlen, max_words - 1);
+  };
+
+  // one executor pair per pool worker, arenas sized for the longest utterance
+  int corpus_enc = ((std::max(corpus_frames, min_frames) - 1) / 2 - 1) / 2;
+  std::map<std::string, Shape> decoder_shapes{
+    { "words", Shape{ maxLength(corpus_enc) + 1 } },
+    { "encoder", Shape{ corpus_enc, cfg.odim } } };
+  std::vector<std::unique_ptr<CpuExecutor>> encoders, decoders, decoders_full;
+  for (int i = 0; i < nj; ++i) {
+    int node = pool->workerNode(i);
+    encoders.emplace_back(new CpuExecutor(encoders_r[node], { { "data", Shape{ 1, 1, cfg.idim, std::max(corpus_frames, min_frames) } } }));
+    decoders.emplace_back(new CpuExecutor(decoders_r[node], decoder_shapes));
+    if (draft)
+      decoders_full.emplace_back(new CpuExecutor(decoders_full_r[node], decoder_shapes));
+  }
+  logMemoryPlan(encoders[0]->memoryPlan(), "encoder");
+  logMemoryPlan(decoders[0]->memoryPlan(), "decoder");
+
+  std::vector<std::string> dict = readDict(configure["--dict"], cfg.nvocab);
+  std::ofstream ofs(configure["--output"]);
+  if (ofs.fail()) {
+    std::cerr << configure["--output"] << " open fail!" << std::endl;
+    exit(0);
+  }
+  std::ofstream tfs;
+  if (configure["--timestamps"] != "") {
+    tfs.open(configure["--timestamps"]);
+    if (tfs.fail()) {
+      std::cerr << configure["--timestamps"] << " open fail!" << std::endl;
+      exit(0);
+    }
+  }
+
+  StageCounter read("read", "frames"), encode("encode", "frames");
+  StageCounter search("search", "tokens"), write("write", "tokens");
+  DraftStats draft_stats;
+  // --ctc_draft compare: thread CPU time and decoder calls of both searches
+  std::atomic<int64_t> beam_cpu_ns{ 0 }, draft_cpu_ns{ 0 }, beam_calls{ 0 }, draft_calls{ 0 };
+  std::atomic<int64_t> agree{ 0 }, nsegments{ 0 }, ncompared{ 0 };
+  Semaphore slots(inflight);
+  BoundedQueue<std::shared_ptr<DecodeJob>> results(inflight);
+
+  // latencies per segment (queue_slots .. queue_write), per decoder call and
+  // per recording (request, read to written). A stage ends where the wait for
+  // the next one begins, the same clock read closes one and stamps the other;
+  // scopes without a hand off use ScopedLatency
+  Metrics metrics;
+  const int m_queue_slots = metrics.histogram("queue_slots");
+  const int m_feature = metrics.histogram("feature");
+  const int m_queue_encode = metrics.histogram("queue_encode");
+  const int m_encode = metrics.histogram("encode");
+  const int m_queue_search = metrics.histogram("queue_search");
+  const int m_search = metrics.histogram("search");
+  const int m_ctc = metrics.histogram("ctc_draft");
+  const int m_queue_write = metrics.histogram("queue_write");
+  const int m_request = metrics.histogram("request");
+  const int m_frames = metrics.counter("frames");
+  const int m_tokens = metrics.counter("tokens");
+  const int m_segments = metrics.counter("segments");
+  const int m_recordings = metrics.counter("recordings");
+  SearchMetrics search_metrics;
+  search_metrics.metrics = &metrics;
+  search_metrics.step = metrics.histogram("decoder_step");
+  search_metrics.steps = metrics.counter("decoder_steps");
+  search_metrics.hypotheses = metrics.counter("hypotheses");
+  search_metrics.capacity = metrics.counter("beam_slots");
+  metrics.ratio("decoder_steps_per_utterance", search_metrics.steps, m_recordings);
+  metrics.ratio("decoder_steps_per_segment", search_metrics.steps, m_segments);
+  metrics.ratio("batch_fill", search_metrics.hypotheses, search_metrics.capacity);
+  MetricsDumper dumper(metrics, configure["--metrics"], std::stod(configure["--metrics_interval"]));
+  int64_t start = nowNs();
+
+  std::thread writer([&] {
+    std::shared_ptr<DecodeJob> job;
+    while (results.pop(job)) {
+      int64_t t0 = nowNs();
+      metrics.record(m_queue_write, t0 - job->queued_ns);
+      Recording& rec = *job->rec;
+      rec.tokens[job->segment] = job->tokens;
+      slots.release();
+      if (++rec.done < (int)rec.segments.size())
+        continue;
+      std::vector<int> tokens = stitchSegments(rec.tokens);
+      ofs << rec.key;
+      for (int token : tokens)
+        ofs << " " << dict[token];
+      ofs << "\n";
+      for (size_t i = 0; i < rec.segments.size() && tfs.is_open(); ++i) {
+        tfs << rec.key << " " << rec.segments[i].begin * frame_shift << " " << rec.segments[i].end * frame_shift;
+        for (int token : rec.tokens[i])
+          tfs << " " << dict[token];
+        tfs << "\n";
+      }
+      write.add(tokens.size(), t0);
+      metrics.record(m_request, nowNs() - rec.begin_ns);
+      metrics.add(m_recordings);
+    }
+  });
+
+  {
+    for (auto& utt : utts) {
+      int64_t t0 = nowNs();
+      auto rec = std::make_shared<Recording>();
+      rec->key = utt.key;
+      rec->begin_ns = t0;
+      MatrixView view = ark.read(utt);
+      if (view.rows > max_frames)
+        rec->segments = segmentByActivity(frameEnergy(view), max_frames, min_frames);
+      else
+        rec->segments.push_back({ 0, view.rows });
+      rec->tokens.resize(rec->segments.size());
+
+      for (int i = 0; i < (int)rec->segments.size(); ++i) {
+        int64_t wait = nowNs();
+        slots.acquire();
+        wait = nowNs() - wait;
+        metrics.record(m_queue_slots, wait);
+        // the wait for a slot is queueing, not reading
+        if (i > 0)
+          t0 = nowNs();
+        else
+          t0 += wait;
+        const Segment& seg = rec->segments[i];
+        auto job = std::make_shared<DecodeJob>();
+        job->rec = rec;
+        job->segment = i;
+        job->frames = seg.end - seg.begin;
+        job->feats.resize((size_t)job->frames * view.cols);
+        for (int t = seg.begin; t < seg.end; ++t)
+          for (int f = 0; f < view.cols; ++f)
+            job->feats[(size_t)f * job->frames + t - seg.begin] = view.at(t, f);
+        read.add(job->frames, t0);
+        nsegments++;
+        job->queued_ns = nowNs();
+        metrics.record(m_feature, job->queued_ns - t0);
+        metrics.add(m_segments);
+        metrics.add(m_frames, job->frames);
+
+        pool->submit([&, job] {
+          int64_t t1 = nowNs();
+          metrics.record(m_queue_encode, t1 - job->queued_ns);
+          CpuExecutor& enc = *encoders[ThreadPool::currentWorker()];
+          enc.setInput("data", job->feats.data(), Shape{ 1, 1, cfg.idim, job->frames });
+          enc.run();
+          Shape shape;
+          const float* memory = enc.outputData("encoder", shape);
+          job->enc_frames = shape.d[0];
+          job->memory.assign(memory, memory + shape.count());
+          if (draft) {
+            const float* ctc = enc.outputData("log_ctc_prob", shape);
+            job->ctc.assign(ctc, ctc + shape.count());
+          }
+          std::vector<float>().swap(job->feats);
+          encode.add(job->frames, t1);
+          job->queued_ns = nowNs();
+          metrics.record(m_encode, job->queued_ns - t1);
+
+          // lands on this worker's deque, idle workers may steal it
+          pool->submit([&, job] {
+            int64_t t2 = nowNs();
+            metrics.record(m_queue_search, t2 - job->queued_ns);
+            int maxlen = maxLength(job->enc_frames);
+            int w = ThreadPool::currentWorker();
+            std::vector<int> beam_tokens;
+            auto beamSearch = [&] {
+              // with compare only the kept (draft) search is counted
+              BeamSearch bs(*decoders[w], sos, eos, beam, penalty, draft ? SearchMetrics() : search_metrics);
+              int64_t cpu = threadCpuNs();
+              beam_tokens = bs.search(job->memory.data(), job->enc_frames, cfg.odim, maxlen);
+              beam_cpu_ns += threadCpuNs() - cpu;
+              beam_calls += bs.decoderCalls();
+            };
+            auto draftSearch = [&] {
+              BeamSearch resume(*decoders[w], sos, eos, beam, penalty, search_metrics);
+              CtcDraftDecoder spec(*decoders_full[w], resume, sos, eos);
+              DraftStats stats;
+              ScopedLatency latency(metrics, m_ctc);
+              int64_t cpu = threadCpuNs();
+              job->tokens = spec.decode(job->memory.data(), job->ctc.data(),
+                job->enc_frames, cfg.odim, cfg.nvocab, maxlen, stats);
+              draft_cpu_ns += threadCpuNs() - cpu;
+              draft_stats.add(stats);
+              draft_calls += stats.decoder_calls;
+            };
+            if (!draft) {
+              beamSearch();
+              job->tokens = beam_tokens;
+            }
+            else if (!compare)
+              draftSearch();
+            else {
+              // alternated, whichever runs second finds the caches warm
+              if (ncompared++ % 2 == 0) {
+                beamSearch();
+                draftSearch();
+              }
+              else {
+                draftSearch();
+                beamSearch();
+              }
+              agree += job->tokens == beam_tokens;
+            }
+            search.add(job->tokens.size(), t2);
+            job->queued_ns = nowNs();
+            metrics.record(m_search, job->queued_ns - t2);
+            metrics.add(m_tokens, job->tokens.size());
+            results.push(job);
+          });
+        }, (int)(nsegments % topology.size()));
+      }
+    }
+    pool->wait();
+    std::cout << "[STAGE] pool steals: " << pool->steals() << ", across nodes: " << pool->remoteSteals() << std::endl;
+    pool.reset();
+  }
+  results.close();
+  writer.join();
+  ofs.close();
+
+  double wall = (nowNs() - start) / 1e9;
+  read.report(wall);
+  encode.report(wall);
+  search.report(wall);
+  write.report(wall);
+  std::cout << "[STAGE] decoder calls: " << (draft ? draft_calls : beam_calls) << ", wall " << wall << " s" << std::endl;
+  if (draft)
+    draft_stats.report();
+  if (compare)
+    std::cout << "[DRAFT] search speedup " << (draft_cpu_ns ? (double)beam_cpu_ns / draft_cpu_ns : 0.0)
+      << "x over beam search in thread CPU time, decoder calls " << beam_calls << " -> " << draft_calls
+      << " (" << (beam_calls ? 100.0 * (beam_calls - draft_calls) / beam_calls : 0.0) << "% fewer), "
+      << agree << "/" << nsegments << " segments identical" << std::endl;
+}
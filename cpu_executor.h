@@ -0,0 +1,347 @@
+#pragma once
+
+#include <map>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <iostream>
+#include "ir.h"
+#include "ir_passes.h"
+#include "ir_builder.h"
+#include "cpu_kernels.h"
+#include "thread_pool.h"
+#include "memory_planner.h"
+
+// Host side tensor used to feed and read the CPU executor. Integer tensors
+// (words, topk index) keep their int32 bits in the float storage.
+struct HostTensor {
+  Shape shape;
+  std::vector<float> data;
+
+  int* ints() { return (int*)data.data(); }
+  const int* ints() const { return (const int*)data.data(); }
+};
+
+HostTensor makeIntTensor(Shape shape, const std::vector<int>& ids) {
+  HostTensor tensor;
+  tensor.shape = shape;
+  tensor.data.resize(ids.size());
+  memcpy(tensor.data.data(), ids.data(), ids.size() * sizeof(int));
+  return tensor;
+}
+
+// Executes an IR graph on the CPU with the reference kernels. Activations and
+// kernel scratch live in one arena planned at construction for max_shapes, so
+// setInput / run / outputData do not touch the heap. The arena is allocated by
+// the first run(), so its pages are first touched on the thread (and NUMA
+// node) that runs the executor. With a ParallelFor the kernels that support
+// it split their work over its threads.
+class CpuExecutor {
+public:
+  CpuExecutor(const Graph& graph, const std::map<std::string, Shape>& max_shapes,
+    ParallelFor* parallel = nullptr)
+    : graph(graph), parallel(parallel), threads(parallel ? parallel->size() : 1),
+      plan(planMemory(graph, max_shapes, threads)) {
+    shapes.resize(graph.values.size());
+    bound.assign(graph.values.size(), nullptr);
+  }
+
+  const MemoryPlan& memoryPlan() const { return plan; }
+
+  // the data is read in place and must stay valid during run()
+  void setInput(const std::string& name, const float* data, Shape shape) {
+    int id = graph.findValue(name);
+    if (id < 0) {
+      std::cerr << "no input named " << name << std::endl;
+      exit(0);
+    }
+    bound[id] = (float*)data;
+    shapes[id] = shape;
+  }
+
+  void run() {
+    if (!arena.reserved())
+      arena.reserve(plan.peak);
+    inferShapes(graph, shapes);
+    for (int i = 0; i < (int)graph.nodes.size(); ++i) {
+      const Node& node = graph.nodes[i];
+      for (int o : node.outputs)
+        if (o >= 0 && shapes[o].count() * 4 > plan.sizes[o]) {
+          std::cerr << graph.values[o].name << " exceeds the planned arena shape" << std::endl;
+          exit(0);
+        }
+      if (workspaceBytes(node, shapes, threads) > plan.workspace_sizes[i]) {
+        std::cerr << node.name << " exceeds the planned workspace" << std::endl;
+        exit(0);
+      }
+      workspace = plan.workspace[i] >= 0 ? arena.at(plan.workspace[i]) : nullptr;
+      runNode(node);
+    }
+  }
+
+  const float* outputData(const std::string& name, Shape& shape) {
+    int id = graph.findValue(name);
+    if (id < 0 || (plan.offsets[id] < 0 && !bound[id])) {
+      std::cerr << "no output named " << name << std::endl;
+      exit(0);
+    }
+    shape = shapes[id];
+    return ptr(id);
+  }
+
+  void run(const std::map<std::string, HostTensor>& inputs) {
+    for (auto& kv : inputs)
+      setInput(kv.first, kv.second.data.data(), kv.second.shape);
+    run();
+  }
+
+  HostTensor output(const std::string& name) {
+    HostTensor tensor;
+    const float* data = outputData(name, tensor.shape);
+    tensor.data.assign(data, data + tensor.shape.count());
+    return tensor;
+  }
+
+private:
+  float* ptr(int value) {
+    if (value < 0)
+      return nullptr;
+    return bound[value] ? bound[value] : (float*)arena.at(plan.offsets[value]);
+  }
+
+  void runNode(const Node& node) {
+    const Shape& in = shapes[node.inputs[0]];
+    float* x = ptr(node.inputs[0]);
+    float* y = ptr(node.outputs[0]);
+    switch (node.op) {
+    case OpType::kConv2d:
+      cpuConv2d(x, in.d[1], in.d[2], in.d[3], node.weights[0].values, node.weights[1].values,
+        node.outsize, node.kernel[0], node.kernel[1], node.stride[0], node.stride[1], node.relu, y);
+      break;
+    case OpType::kRelu:
+      for (int64_t i = 0; i < in.count(); ++i)
+        y[i] = std::max(x[i], 0.f);
+      break;
+    case OpType::kToSequence:
+      cpuTranspose(x, in.d[1], in.d[2] * in.d[3], y);
+      break;
+    case OpType::kSubsampling: {
+      int idim = in.d[2];
+      int T = in.d[3];
+      if (((idim - 1) / 2 - 1) / 2 != node.kernel[0]) {
+        std::cerr << "input dimension " << idim << " does not match " << node.name << std::endl;
+        exit(0);
+      }
+      int frames = (int)shapes[node.outputs[0]].rows();
+      int64_t scratch = subsamplingScratch(idim, node.outsize, kSubsamplingTile);
+      const Weight* w = node.weights.data();
+      float* ws = (float*)workspace;
+      auto tile = [&](int task, int thread) {
+        int begin = task * kSubsamplingTile;
+        cpuSubsamplingTile(x, idim, T, w[0].values, w[1].values, w[2].values, w[3].values,
+          w[4].values, w[5].values, node.outsize, begin, std::min(frames, begin + kSubsamplingTile),
+          ws + thread * scratch, y);
+      };
+      int tiles = (frames + kSubsamplingTile - 1) / kSubsamplingTile;
+      if (parallel)
+        parallel->run(tiles, tile);
+      else
+        for (int i = 0; i < tiles; ++i)
+          tile(i, 0);
+      break;
+    }
+    case OpType::kPositionWise:
+      if (in.rows() > node.maxseql) {
+        std::cerr << "sequence length " << in.rows() << " exceeds maxseql " << node.maxseql << std::endl;
+        exit(0);
+      }
+      cpuPositionWise(x, (int)in.rows(), in.last(), node.weights[0].values, y);
+      break;
+    case OpType::kEmbedding:
+      cpuEmbedding((const int*)x, (int)in.count(), node.weights[0].values, node.outsize, y);
+      break;
+    case OpType::kFC:
+      cpuFC(x, in.rows(), node.insize, node.weights[0].values, node.weights[1].values,
+        node.outsize, node.transposed, node.relu, y);
+      break;
+    case OpType::kLayerNorm:
+      cpuLayerNorm(x, in.rows(), in.last(), node.weights[0].values, node.weights[1].values, y);
+      break;
+    case OpType::kAdd:
+    case OpType::kAddLayerNorm: {
+      // without a reader for the sum it is built directly in the norm output
+      float* sum = y ? y : ptr(node.outputs[1]);
+      float* b = ptr(node.inputs[1]);
+      for (int64_t i = 0; i < in.count(); ++i)
+        sum[i] = x[i] + b[i];
+      if (node.op == OpType::kAddLayerNorm)
+        cpuLayerNorm(sum, in.rows(), in.last(), node.weights[0].values,
+          node.weights[1].values, ptr(node.outputs[1]));
+      break;
+    }
+    case OpType::kSelfAttention: {
+      int L = (int)in.rows();
+      float* scores = (float*)workspace;
+      if (node.fused_qkv)
+        cpuAttention(x, 3 * node.outsize, x + node.outsize, 3 * node.outsize,
+          x + 2 * node.outsize, 3 * node.outsize, L, L, node.outsize, node.n_head,
+          node.mask, y, scores);
+      else
+        cpuAttention(x, node.outsize, ptr(node.inputs[1]), node.outsize,
+          ptr(node.inputs[2]), node.outsize, L, L, node.outsize, node.n_head,
+          node.mask, y, scores);
+      break;
+    }
+    case OpType::kSrcAttention: {
+      int L = (int)in.rows();
+      int S = (int)shapes[node.inputs[1]].rows();
+      int64_t kv = (int64_t)S * node.outsize;
+      float* scratch = (float*)workspace;
+      float* mem = ptr(node.inputs[1]);
+      cpuFC(mem, S, node.insize, node.weights[0].values, node.weights[1].values,
+        node.outsize, node.transposed, false, scratch);
+      cpuFC(mem, S, node.insize, node.weights[2].values, node.weights[3].values,
+        node.outsize, node.transposed, false, scratch + kv);
+      cpuAttention(x, node.outsize, scratch, node.outsize, scratch + kv,
+        node.outsize, L, S, node.outsize, node.n_head, false, y, scratch + 2 * kv);
+      break;
+    }
+    case OpType::kConcat: {
+      int64_t rows = in.rows();
+      int offset = 0;
+      int out = shapes[node.outputs[0]].last();
+      for (int i : node.inputs) {
+        int d = shapes[i].last();
+        for (int64_t r = 0; r < rows; ++r)
+          memcpy(y + r * out + offset, ptr(i) + r * d, d * sizeof(float));
+        offset += d;
+      }
+      break;
+    }
+    case OpType::kFinalSlice:
+      memcpy(y, x + (in.rows() - 1) * in.last(), in.last() * sizeof(float));
+      break;
+    case OpType::kSoftmax:
+      cpuSoftmax(x, in.rows(), in.last(), y);
+      break;
+    case OpType::kLog:
+      for (int64_t i = 0; i < in.count(); ++i)
+        y[i] = std::log(x[i]);
+      break;
+    case OpType::kTopK:
+      cpuTopK(x, in.rows(), in.last(), node.topk, y, (int*)ptr(node.outputs[1]), (int*)workspace);
+      break;
+    default:
+      break;
+    }
+  }
+
+  const Graph& graph;
+  ParallelFor* parallel;
+  int threads;
+  MemoryPlan plan;
+  Arena arena;
+  std::vector<Shape> shapes;
+  std::vector<float*> bound;
+  char* workspace = nullptr;
+};
+
+// Runs both graphs on the same inputs and compares every graph output, used
+// to check that the IR passes keep the numerics of the unoptimized graph.
+bool checkEquivalence(const Graph& reference, const Graph& optimized,
+  const std::map<std::string, HostTensor>& inputs, float tol = 1e-3f) {
+  std::map<std::string, Shape> input_shapes;
+  for (auto& kv : inputs)
+    input_shapes[kv.first] = kv.second.shape;
+  CpuExecutor ref(reference, input_shapes), opt(optimized, input_shapes);
+  ref.run(inputs);
+  opt.run(inputs);
+
+  bool pass = true;
+  for (int o : reference.outputs) {
+    const Value& value = reference.values[o];
+    HostTensor a = ref.output(value.name);
+    HostTensor b = opt.output(value.name);
+    if (a.data.size() != b.data.size()) {
+      std::cout << "[IR] " << value.name << " shape mismatch" << std::endl;
+      pass = false;
+      continue;
+    }
+    if (value.is_int) {
+      int64_t mismatch = 0;
+      for (size_t i = 0; i < a.data.size(); ++i)
+        mismatch += a.ints()[i] != b.ints()[i];
+      std::cout << "[IR] " << value.name << " mismatches: " << mismatch << std::endl;
+      pass = pass && mismatch == 0;
+    }
+    else {
+      float diff = 0.f;
+      for (size_t i = 0; i < a.data.size(); ++i)
+        diff = std::max(diff, std::fabs(a.data[i] - b.data[i]));
+      std::cout << "[IR] " << value.name << " max abs diff: " << diff << std::endl;
+      pass = pass && diff <= tol;
+    }
+  }
+  return pass;
+}
+
+// Deterministic pseudo random weights, lets graphs run without a model dump.
+class RandomWeightLoader : public WeightLoader {
+public:
+  RandomWeightLoader(uint32_t seed = 1) : state(seed) {}
+
+  Weight load(const std::string& /*file*/, int64_t count) override {
+    std::vector<float> data(count);
+    for (auto& v : data)
+      v = next() * 0.1f;
+    return makeWeight(std::move(data));
+  }
+
+  // uniform in [-1, 1)
+  float next() {
+    state = state * 1664525u + 1013904223u;
+    return (state >> 8) * (2.f / 16777216.f) - 1.f;
+  }
+
+private:
+  uint32_t state;
+};
+
+// Builds encoder and decoder twice, optimizes one copy with the CPU passes and
+// compares both on random features. The arena plans for the max profile
+// shapes are reported as well.
+bool verifyPasses(const ModelConfig& cfg, WeightLoader& loader, int frames = 200, int words = 8) {
+  IRBuilder builder(cfg, loader);
+  RandomWeightLoader random(7);
+  PassOptions options;
+
+  Graph encoder = builder.BuildEncoder();
+  Graph encoder_opt = encoder;
+  runPasses(encoder_opt, options);
+  logMemoryPlan(planMemory(encoder_opt, maxEncoderShapes(cfg)), "encoder");
+  HostTensor data;
+  data.shape = Shape{ 1, 1, cfg.idim, frames };
+  data.data.resize(data.shape.count());
+  for (auto& v : data.data)
+    v = random.next();
+  bool pass = checkEquivalence(encoder, encoder_opt, { { "data", data } });
+
+  CpuExecutor run(encoder_opt, { { "data", data.shape } });
+  run.run({ { "data", data } });
+  HostTensor memory = run.output("encoder");
+
+  Graph decoder = builder.BuildDecoder();
+  Graph decoder_opt = decoder;
+  runPasses(decoder_opt, options);
+  logMemoryPlan(planMemory(decoder_opt, maxDecoderShapes(cfg)), "decoder");
+  std::vector<int> ids(words);
+  for (int i = 0; i < words; ++i)
+    ids[i] = (i * 131 + 7) % cfg.nvocab;
+  pass = checkEquivalence(decoder, decoder_opt, {
+    { "words", makeIntTensor(Shape{ words }, ids) },
+    { "encoder", memory } }) && pass;
+
+  std::cout << "[IR] pass equivalence " << (pass ? "PASSED" : "FAILED") << std::endl;
+  return pass;
+}
@@ -0,0 +1,243 @@
+#pragma once
+
+#include <cmath>
+#include <limits>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+// Reference CPU kernels for the IR ops. Tensors are row-major, the last axis
+// is contiguous. None of the kernels allocate, scratch space is passed in.
+
+// y[r,:] = x[r,:] * W^T + b, W is [out,in] or, when transposed, [in,out]
+void cpuFC(const float* x, int64_t rows, int in, const float* w, const float* b,
+  int out, bool transposed, bool relu, float* y) {
+  for (int64_t r = 0; r < rows; ++r) {
+    const float* xr = x + r * in;
+    float* yr = y + r * out;
+    if (transposed) {
+      for (int o = 0; o < out; ++o)
+        yr[o] = b[o];
+      for (int k = 0; k < in; ++k) {
+        float xv = xr[k];
+        const float* wk = w + (int64_t)k * out;
+        for (int o = 0; o < out; ++o)
+          yr[o] += xv * wk[o];
+      }
+    }
+    else {
+      for (int o = 0; o < out; ++o) {
+        const float* wo = w + (int64_t)o * in;
+        float sum = b[o];
+        for (int k = 0; k < in; ++k)
+          sum += xr[k] * wo[k];
+        yr[o] = sum;
+      }
+    }
+    if (relu)
+      for (int o = 0; o < out; ++o)
+        yr[o] = std::max(yr[o], 0.f);
+  }
+}
+
+// espnet LayerNorm uses eps 1e-12, in place operation (x == y) is allowed
+void cpuLayerNorm(const float* x, int64_t rows, int d, const float* gamma,
+  const float* beta, float* y) {
+  for (int64_t r = 0; r < rows; ++r) {
+    const float* xr = x + r * d;
+    float* yr = y + r * d;
+    float mean = 0.f;
+    for (int i = 0; i < d; ++i)
+      mean += xr[i];
+    mean /= d;
+    float var = 0.f;
+    for (int i = 0; i < d; ++i)
+      var += (xr[i] - mean) * (xr[i] - mean);
+    float rstd = 1.f / std::sqrt(var / d + 1e-12f);
+    for (int i = 0; i < d; ++i)
+      yr[i] = (xr[i] - mean) * rstd * gamma[i] + beta[i];
+  }
+}
+
+// multi-head scaled dot product attention, scores needs S floats
+void cpuAttention(const float* q, int ldq, const float* k, int ldk,
+  const float* v, int ldv, int L, int S, int odim, int n_head, bool mask,
+  float* y, float* scores) {
+  int dk = odim / n_head;
+  float scale = 1.f / std::sqrt((float)dk);
+  for (int h = 0; h < n_head; ++h) {
+    for (int i = 0; i < L; ++i) {
+      const float* qi = q + (int64_t)i * ldq + h * dk;
+      int valid = mask ? std::min(S, i + 1) : S;
+      float vmax = -std::numeric_limits<float>::infinity();
+      for (int j = 0; j < valid; ++j) {
+        const float* kj = k + (int64_t)j * ldk + h * dk;
+        float dot = 0.f;
+        for (int c = 0; c < dk; ++c)
+          dot += qi[c] * kj[c];
+        scores[j] = dot * scale;
+        vmax = std::max(vmax, scores[j]);
+      }
+      float sum = 0.f;
+      for (int j = 0; j < valid; ++j) {
+        scores[j] = std::exp(scores[j] - vmax);
+        sum += scores[j];
+      }
+      float* yi = y + (int64_t)i * odim + h * dk;
+      for (int c = 0; c < dk; ++c)
+        yi[c] = 0.f;
+      for (int j = 0; j < valid; ++j) {
+        float p = scores[j] / sum;
+        const float* vj = v + (int64_t)j * ldv + h * dk;
+        for (int c = 0; c < dk; ++c)
+          yi[c] += p * vj[c];
+      }
+    }
+  }
+}
+
+// x [C,H,W], w [O,C,kh,kw] -> y [O,H',W']
+void cpuConv2d(const float* x, int C, int H, int W, const float* w,
+  const float* b, int O, int kh, int kw, int sh, int sw, bool relu, float* y) {
+  int Ho = (H - kh) / sh + 1;
+  int Wo = (W - kw) / sw + 1;
+  for (int o = 0; o < O; ++o)
+    for (int i = 0; i < Ho; ++i)
+      for (int j = 0; j < Wo; ++j) {
+        float sum = b[o];
+        for (int c = 0; c < C; ++c)
+          for (int u = 0; u < kh; ++u)
+            for (int t = 0; t < kw; ++t)
+              sum += x[((int64_t)c * H + i * sh + u) * W + j * sw + t] *
+                w[(((int64_t)o * C + c) * kh + u) * kw + t];
+        y[((int64_t)o * Ho + i) * Wo + j] = relu ? std::max(sum, 0.f) : sum;
+      }
+}
+
+// y[r,:] += x[r * ldx + k] * w[k,:] for k < in, w is [in,out]. All rows are
+// updated with one weight row before moving to the next, so a weight row is
+// read once per call instead of once per row.
+void cpuAccumulateRows(const float* x, int64_t ldx, int rows, int in,
+  const float* w, int out, float* y) {
+  for (int k = 0; k < in; ++k) {
+    const float* wk = w + (int64_t)k * out;
+    for (int r = 0; r < rows; ++r) {
+      float xv = x[r * ldx + k];
+      float* yr = y + (int64_t)r * out;
+      for (int o = 0; o < out; ++o)
+        yr[o] += xv * wk[o];
+    }
+  }
+}
+
+// Conv2dSubsampling front end, conv 3x3/2 + relu, conv 3x3/2 + relu and the
+// [H2,1] output conv, computed for a tile of output frames at a time.
+// Activations are time major ([frame][freq][channel]) so both odim wide convs
+// are rank-1 updates over contiguous channel rows, and the output conv writes
+// the [T',odim] sequence layout directly. Weights come packed by
+// FuseSubsampling as [time tap][freq tap][in channel][odim]: w0 [3,3,1,odim],
+// w1 [3,3,odim,odim], w2 [1,H2,odim,odim].
+const int kSubsamplingTile = 8;
+
+// floats of scratch per tile of output frames, a multiple of 64 bytes so the
+// scratch of parallel tiles never shares a cache line
+int64_t subsamplingScratch(int idim, int odim, int tile) {
+  int H1 = (idim - 1) / 2;
+  int H2 = (H1 - 1) / 2;
+  int64_t floats = ((int64_t)(2 * tile + 1) * H1 + (int64_t)tile * H2) * odim;
+  return (floats + 15) / 16 * 16;
+}
+
+// x [idim,T] -> rows [begin,end) of y [T',odim]
+void cpuSubsamplingTile(const float* x, int idim, int T, const float* w0,
+  const float* b0, const float* w1, const float* b1, const float* w2,
+  const float* b2, int odim, int begin, int end, float* scratch, float* y) {
+  int H1 = (idim - 1) / 2;
+  int H2 = (H1 - 1) / 2;
+  int n = end - begin;
+  // conv 0 frames 2 * begin .. 2 * end feed the n conv 1 frames
+  float* a0 = scratch;
+  float* a1 = scratch + (int64_t)(2 * n + 1) * H1 * odim;
+  for (int f = 0; f < 2 * n + 1; ++f) {
+    int t0 = 2 * (2 * begin + f);
+    for (int i = 0; i < H1; ++i) {
+      float* yr = a0 + ((int64_t)f * H1 + i) * odim;
+      memcpy(yr, b0, odim * sizeof(float));
+      for (int u = 0; u < 3; ++u)
+        for (int t = 0; t < 3; ++t) {
+          float xv = x[(int64_t)(2 * i + u) * T + t0 + t];
+          const float* wk = w0 + (t * 3 + u) * odim;
+          for (int o = 0; o < odim; ++o)
+            yr[o] += xv * wk[o];
+        }
+      for (int o = 0; o < odim; ++o)
+        yr[o] = std::max(yr[o], 0.f);
+    }
+  }
+  // conv 1, output freq p reads conv 0 freq rows 2p..2p+2, a row stride of 2 * odim
+  for (int j = 0; j < n; ++j) {
+    float* yj = a1 + (int64_t)j * H2 * odim;
+    for (int p = 0; p < H2; ++p)
+      memcpy(yj + (int64_t)p * odim, b1, odim * sizeof(float));
+    for (int t = 0; t < 3; ++t)
+      for (int u = 0; u < 3; ++u)
+        cpuAccumulateRows(a0 + ((int64_t)(2 * j + t) * H1 + u) * odim, 2 * odim, H2,
+          odim, w1 + (int64_t)(t * 3 + u) * odim * odim, odim, yj);
+    for (int64_t i = 0; i < (int64_t)H2 * odim; ++i)
+      yj[i] = std::max(yj[i], 0.f);
+  }
+  // the output conv spans all H2 rows, an FC over each [H2 * odim] frame
+  float* yt = y + (int64_t)begin * odim;
+  for (int j = 0; j < n; ++j)
+    memcpy(yt + (int64_t)j * odim, b2, odim * sizeof(float));
+  cpuAccumulateRows(a1, (int64_t)H2 * odim, n, H2 * odim, w2, odim, yt);
+}
+
+// [C,N] -> [N,C]
+void cpuTranspose(const float* x, int C, int N, float* y) {
+  for (int c = 0; c < C; ++c)
+    for (int n = 0; n < N; ++n)
+      y[(int64_t)n * C + c] = x[(int64_t)c * N + n];
+}
+
+void cpuPositionWise(const float* x, int T, int odim, const float* pe, float* y) {
+  float xscale = std::sqrt((float)odim);
+  for (int64_t i = 0; i < (int64_t)T * odim; ++i)
+    y[i] = x[i] * xscale + pe[i];
+}
+
+void cpuEmbedding(const int* ids, int n, const float* table, int odim, float* y) {
+  for (int i = 0; i < n; ++i)
+    memcpy(y + (int64_t)i * odim, table + (int64_t)ids[i] * odim, odim * sizeof(float));
+}
+
+void cpuSoftmax(const float* x, int64_t rows, int d, float* y) {
+  for (int64_t r = 0; r < rows; ++r) {
+    const float* xr = x + r * d;
+    float* yr = y + r * d;
+    float vmax = *std::max_element(xr, xr + d);
+    float sum = 0.f;
+    for (int i = 0; i < d; ++i) {
+      yr[i] = std::exp(xr[i] - vmax);
+      sum += yr[i];
+    }
+    for (int i = 0; i < d; ++i)
+      yr[i] /= sum;
+  }
+}
+
+// idx needs d ints of scratch per call
+void cpuTopK(const float* x, int64_t rows, int d, int k, float* prob, int* index, int* idx) {
+  for (int64_t r = 0; r < rows; ++r) {
+    const float* xr = x + r * d;
+    for (int i = 0; i < d; ++i)
+      idx[i] = i;
+    std::partial_sort(idx, idx + k, idx + d, [xr](int a, int b) {
+      return xr[a] > xr[b] || (xr[a] == xr[b] && a < b);
+    });
+    for (int i = 0; i < k; ++i) {
+      prob[r * k + i] = xr[idx[i]];
+      index[r * k + i] = idx[i];
+    }
+  }
+}
@@ -0,0 +1,58 @@
+
+#include <map>
+#include <iostream>
+#include "corpus_decoder.h"
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    std::cout
+      << "--feats [Kaldi feats.scp with binary ark entries, Required!]" << std::endl
+      << "--output [the output transcript file, default decode.txt]" << std::endl
+      << "--dict [ESPnet units file to map token ids, default none]" << std::endl
+      << "--beam [beam size, default 5]" << std::endl
+      << "--penalty [insertion penalty per token, default 0]" << std::endl
+      << "--maxlenratio [max output length / encoder length, 0 uses the encoder length, default 0]" << std::endl
+      << "--nj [the number of pool threads, default hardware concurrency]" << std::endl
+      << "--inflight [the max segments in the pipeline, default 2 * nj]" << std::endl
+      << "--max_frames [longer recordings are segmented, at most the encoder profile, default 6000]" << std::endl
+      << "--timestamps [per segment \"key begin end tokens\" output file, default none]" << std::endl
+      << "--frame_shift [feature frame shift in seconds, default 0.01]" << std::endl
+      << "--numa [pin workers per NUMA node with node local weight replicas {false/true}, default false]" << std::endl
+      << "--numa_nodes [split the cpus into this many logical nodes instead of the detected ones, default 0]" << std::endl
+      << "--metrics [metrics snapshot file, rewritten every --metrics_interval, default none]" << std::endl
+      << "--metrics_interval [seconds between metrics snapshots, default 10]" << std::endl
+      << "--ctc_draft [verify the greedy CTC hypothesis in one decoder pass {false/true/compare}, default false]" << std::endl
+      << "--path [the transformer model weight path, Required!]" << std::endl
+      << "--idim [input feature dimension, default 83]" << std::endl
+      << "--n_Head [the number of head in attention, default 4]" << std::endl
+      << "--odim [feature dimension, default 256]" << std::endl
+      << "--feed_forward [feed forward dimension, default 2048]" << std::endl
+      << "--nvocab [the size of vocabulary, Required!]" << std::endl
+      << "--concat_after [concat is used, default false]" << std::endl
+      << "--normalize_before [default true]" << std::endl
+      << "--encoder_layers [the number of attention in encoder, default 12]" << std::endl
+      << "--decoder_layers [the number of attention in decoder, default 6]" << std::endl
+      << "--topk [the topk in each decoder step, default 16]" << std::endl
+      << "--maxseql [the max sequence length of encoder, default 5000]" << std::endl;
+  }
+  std::map<std::string, std::string> configure = decodeOptions();
+
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (configure.count(argv[i]) > 0) {
+      configure[argv[i]] = argv[i + 1];
+    }
+    else {
+      std::cerr << "Option is not supported!" << std::endl;
+      exit(0);
+    }
+  }
+
+  if (configure["--feats"] == "") {
+    std::cerr << "The feats.scp is not specified!" << std::endl;
+    std::cout << "To see more information by running program without option input!" << std::endl;
+    exit(0);
+  }
+
+  decodeCorpus(configure);
+  return 0;
+}
@@ -0,0 +1,317 @@
+#pragma once
+
+#include <map>
+#include <cmath>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+
+// Typed intermediate representation of the espnet transformer. The graph is
+// built once from ModelConfig, rewritten by the passes in ir_passes.h and then
+// lowered either to TensorRT (ir_trt.h) or to the CPU executor (cpu_executor.h).
+
+struct Weight {
+  const float* values = nullptr;
+  int64_t count = 0;
+  std::shared_ptr<const void> owner;
+};
+
+Weight makeWeight(std::vector<float> data) {
+  auto holder = std::make_shared<std::vector<float>>(std::move(data));
+  Weight weight;
+  weight.values = holder->data();
+  weight.count = (int64_t)holder->size();
+  weight.owner = holder;
+  return weight;
+}
+
+class WeightLoader {
+public:
+  virtual ~WeightLoader() {}
+  virtual Weight load(const std::string& file, int64_t count) = 0;
+
+  // constants the passes compute from loaded weights (transposed, packed,
+  // merged) go through here, loaders that share weights between models
+  // share these as well
+  virtual Weight derive(const std::string& /*op*/, const std::vector<Weight>& /*sources*/,
+    const std::function<Weight()>& make) {
+    return make();
+  }
+};
+
+class FileWeightLoader : public WeightLoader {
+public:
+  Weight load(const std::string& file, int64_t count) override {
+    std::cout << "loading weight from " << file << std::endl;
+    std::ifstream ifs(file, std::ios::binary);
+    if (ifs.fail()) {
+      std::cout << file << " open fail!" << std::endl;
+      exit(0);
+    }
+    ifs.seekg(0, std::ios::end);
+    size_t len = ifs.tellg();
+    ifs.seekg(0, std::ios::beg);
+    if (len != count * sizeof(float)) {
+      std::cout << file << " size mismatch, expect " << count * sizeof(float) << " got " << len << std::endl;
+      exit(0);
+    }
+    std::vector<float> data(count);
+    ifs.read((char*)data.data(), len);
+    ifs.close();
+    return makeWeight(std::move(data));
+  }
+};
+
+struct ModelConfig {
+  std::string path;
+  std::string model_name;
+  int idim = 83;
+  int odim = 256;
+  int n_head = 4;
+  int feed_forward = 2048;
+  int nvocab = 7244;
+  int encoder_layers = 12;
+  int decoder_layers = 6;
+  int batchsize = 16;
+  int topk = 16;
+  int maxseql = 5000;
+  bool half = false;
+  bool concat_after = false;
+  bool normalize_before = true;
+};
+
+// the command line map is parsed exactly once, layers only see typed fields
+ModelConfig parseConfig(std::map<std::string, std::string> configure) {
+  ModelConfig cfg;
+  cfg.path = configure["--path"];
+  cfg.model_name = configure["--model_name"];
+  cfg.idim = std::stoi(configure["--idim"]);
+  cfg.odim = std::stoi(configure["--odim"]);
+  cfg.n_head = std::stoi(configure["--n_Head"]);
+  cfg.feed_forward = std::stoi(configure["--feed_forward"]);
+  cfg.nvocab = std::stoi(configure["--nvocab"]);
+  cfg.encoder_layers = std::stoi(configure["--encoder_layers"]);
+  cfg.decoder_layers = std::stoi(configure["--decoder_layers"]);
+  cfg.batchsize = std::stoi(configure["--batchsize"]);
+  cfg.topk = std::stoi(configure["--topk"]);
+  cfg.maxseql = std::stoi(configure["--maxseql"]);
+  cfg.half = configure["--dtype"] == "half";
+  cfg.concat_after = configure["--concat_after"] == "true";
+  cfg.normalize_before = configure["--normalize_before"] == "true";
+  return cfg;
+}
+
+enum class OpType {
+  kConv2d,        // [1,C,H,W] -> [1,O,H',W'], optional fused relu
+  kRelu,
+  kToSequence,    // [1,O,H,W] -> [H*W,O]
+  kSubsampling,   // [1,1,idim,T] -> [T',odim], the whole conv front end (CPU)
+  kPositionWise,  // x * sqrt(odim) + pe[t]
+  kEmbedding,     // int indices -> rows of weight[nvocab,odim]
+  kFC,            // x * W^T + b, optional fused relu
+  kLayerNorm,
+  kAdd,
+  kAddLayerNorm,  // outputs {a + b, LayerNorm(a + b)}
+  kSelfAttention, // inputs {q,k,v} or a single fused qkv
+  kSrcAttention,  // inputs {q,memory}, weights {kw,kb,vw,vb}
+  kConcat,        // along the last axis
+  kFinalSlice,    // last position of the sequence -> [1,D]
+  kSoftmax,       // along the last axis
+  kLog,
+  kTopK           // outputs {prob, index} along the last axis
+};
+
+struct Shape {
+  int nb = 0;
+  int d[4] = { 0, 0, 0, 0 };
+
+  Shape() {}
+  Shape(std::initializer_list<int> dims) {
+    for (int v : dims)
+      d[nb++] = v;
+  }
+  int64_t count() const {
+    int64_t c = 1;
+    for (int i = 0; i < nb; ++i)
+      c *= d[i];
+    return c;
+  }
+  int last() const { return d[nb - 1]; }
+  int64_t rows() const { return count() / last(); }
+};
+
+struct Value {
+  std::string name;
+  bool is_int = false;
+  Shape dims; // only meaningful for graph inputs, -1 marks a dynamic axis
+};
+
+struct Node {
+  OpType op;
+  std::string name;
+  std::vector<int> inputs;
+  std::vector<int> outputs; // -1 marks an output nobody reads
+  std::vector<Weight> weights;
+  int insize = 0;
+  int outsize = 0;
+  int kernel[2] = { 1, 1 };
+  int stride[2] = { 1, 1 };
+  int n_head = 0;
+  int topk = 0;
+  int maxseql = 0;
+  bool mask = false;
+  bool relu = false;
+  bool transposed = false; // FC / SrcAttention weights stored as [in,out]
+  bool fused_qkv = false;
+};
+
+struct Graph {
+  std::vector<Value> values;
+  std::vector<Node> nodes; // always kept in topological order
+  std::vector<int> inputs;
+  std::vector<int> outputs;
+
+  int addValue(const std::string& name, bool is_int = false) {
+    Value value;
+    value.name = name;
+    value.is_int = is_int;
+    values.push_back(value);
+    return (int)values.size() - 1;
+  }
+
+  int addInput(const std::string& name, Shape dims, bool is_int = false) {
+    int id = addValue(name, is_int);
+    values[id].dims = dims;
+    inputs.push_back(id);
+    return id;
+  }
+
+  std::vector<int> addNode(Node node, int nout = 1) {
+    for (int i = 0; i < nout; ++i)
+      node.outputs.push_back(addValue(node.name + ":" + std::to_string(i)));
+    nodes.push_back(node);
+    return nodes.back().outputs;
+  }
+
+  int add(Node node) { return addNode(node, 1)[0]; }
+
+  void markOutput(int value, const std::string& name) {
+    values[value].name = name;
+    outputs.push_back(value);
+  }
+
+  int findValue(const std::string& name) const {
+    for (int i = 0; i < (int)values.size(); ++i)
+      if (values[i].name == name)
+        return i;
+    return -1;
+  }
+
+  // index of the node producing value, -1 for graph inputs
+  int producer(int value) const {
+    for (int i = 0; i < (int)nodes.size(); ++i)
+      for (int o : nodes[i].outputs)
+        if (o == value)
+          return i;
+    return -1;
+  }
+
+  std::vector<int> consumers(int value) const {
+    std::vector<int> users;
+    for (int i = 0; i < (int)nodes.size(); ++i)
+      for (int in : nodes[i].inputs)
+        if (in == value) {
+          users.push_back(i);
+          break;
+        }
+    return users;
+  }
+
+  bool isOutput(int value) const {
+    for (int o : outputs)
+      if (o == value)
+        return true;
+    return false;
+  }
+
+  void replaceUses(int from, int to) {
+    for (auto& node : nodes)
+      for (auto& in : node.inputs)
+        if (in == from)
+          in = to;
+    for (auto& o : outputs)
+      if (o == from) {
+        values[to].name = values[from].name;
+        o = to;
+      }
+  }
+};
+
+// fills the shapes of every node output, shapes of the graph inputs must be
+// set and shapes must hold one entry per value
+void inferShapes(const Graph& graph, std::vector<Shape>& shapes) {
+  for (auto& node : graph.nodes) {
+    Shape in = shapes[node.inputs[0]];
+    Shape out = in;
+    switch (node.op) {
+    case OpType::kConv2d:
+      out = Shape{ in.d[0], node.outsize,
+        (in.d[2] - node.kernel[0]) / node.stride[0] + 1,
+        (in.d[3] - node.kernel[1]) / node.stride[1] + 1 };
+      break;
+    case OpType::kToSequence:
+      out = Shape{ in.d[2] * in.d[3], in.d[1] };
+      break;
+    case OpType::kSubsampling:
+      out = Shape{ ((in.d[3] - 1) / 2 - 1) / 2, node.outsize };
+      break;
+    case OpType::kEmbedding:
+      out = in;
+      out.d[out.nb++] = node.outsize;
+      break;
+    case OpType::kFC:
+      out.d[out.nb - 1] = node.outsize;
+      break;
+    case OpType::kSelfAttention:
+      if (node.fused_qkv)
+        out.d[out.nb - 1] /= 3;
+      break;
+    case OpType::kConcat:
+      out.d[out.nb - 1] = 0;
+      for (int i : node.inputs)
+        out.d[out.nb - 1] += shapes[i].last();
+      break;
+    case OpType::kFinalSlice:
+      out = Shape{ 1, in.last() };
+      break;
+    case OpType::kTopK:
+      out.d[out.nb - 1] = node.topk;
+      break;
+    default:
+      break;
+    }
+    for (int o : node.outputs)
+      if (o >= 0)
+        shapes[o] = out;
+  }
+}
+
+// concrete shapes of every value for the given input shapes
+std::vector<Shape> inferShapes(const Graph& graph, const std::map<std::string, Shape>& input_shapes) {
+  std::vector<Shape> shapes(graph.values.size());
+  for (int in : graph.inputs) {
+    auto it = input_shapes.find(graph.values[in].name);
+    if (it == input_shapes.end()) {
+      std::cerr << "missing shape for input " << graph.values[in].name << std::endl;
+      exit(0);
+    }
+    shapes[in] = it->second;
+  }
+  inferShapes(graph, shapes);
+  return shapes;
+}
@@ -0,0 +1,284 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "ir.h"
+
+// Builds the espnet transformer encoder / decoder as IR graphs. Layer helpers
+// mirror the names of the original network construction functions.
+class IRBuilder {
+public:
+  IRBuilder(const ModelConfig& cfg, WeightLoader& loader)
+    : cfg(cfg), loader(loader) {}
+
+  Graph BuildEncoder() {
+    graph = Graph();
+    int input = graph.addInput("data", Shape{ 1, 1, cfg.idim, -1 });
+    int bottom = Conv2dSubsampling(input);
+    bottom = Encoder_Layers(bottom);
+
+    //CTC Prob
+    int ctc_fcn = FC(bottom, cfg.odim, cfg.nvocab, cfg.path + "/ctc.ctc_lo");
+    int ctc_softmax = Unary(OpType::kSoftmax, ctc_fcn, "ctc.softmax");
+    int ctc_log = Unary(OpType::kLog, ctc_softmax, "ctc.log");
+    graph.markOutput(ctc_log, "log_ctc_prob");
+    graph.markOutput(bottom, "encoder");
+    return graph;
+  }
+
+  // the convolution front end alone, for kernel benchmarks
+  Graph BuildSubsampling() {
+    graph = Graph();
+    int input = graph.addInput("data", Shape{ 1, 1, cfg.idim, -1 });
+    graph.markOutput(Conv2dSubsampling(input), "embed");
+    return graph;
+  }
+
+  // all_positions keeps the topk of every prefix position instead of only the
+  // last one, used to verify a whole draft hypothesis in one pass
+  Graph BuildDecoder(bool all_positions = false) {
+    graph = Graph();
+    int words = graph.addInput("words", Shape{ -1 }, true);
+    int encoder = graph.addInput("encoder", Shape{ -1, cfg.odim });
+    int bottom = PositionalEncoding(words);
+    bottom = Decoder_Layers(bottom, encoder);
+
+    if (!all_positions)
+      bottom = Unary(OpType::kFinalSlice, bottom, "decoder.final_slice");
+    if (cfg.normalize_before)
+      bottom = LayerNormalization(bottom, cfg.path + "/decoder.after_norm");
+
+    bottom = FC(bottom, cfg.odim, cfg.nvocab, cfg.path + "/decoder.output_layer");
+    bottom = Unary(OpType::kSoftmax, bottom, "decoder.softmax");
+
+    Node topk;
+    topk.op = OpType::kTopK;
+    topk.name = "decoder.topk";
+    topk.inputs = { bottom };
+    topk.topk = cfg.topk;
+    auto outs = graph.addNode(topk, 2);
+    graph.values[outs[1]].is_int = true;
+    graph.markOutput(outs[0], "prob");
+    graph.markOutput(outs[1], "index");
+    return graph;
+  }
+
+private:
+  int Unary(OpType op, int input, const std::string& name) {
+    Node node;
+    node.op = op;
+    node.name = name;
+    node.inputs = { input };
+    return graph.add(node);
+  }
+
+  int Add(int a, int b, const std::string& name) {
+    Node node;
+    node.op = OpType::kAdd;
+    node.name = name;
+    node.inputs = { a, b };
+    return graph.add(node);
+  }
+
+  int Conv2d(int input, int inc, int kh, int kw, int sh, int sw, const std::string& prefix) {
+    Node node;
+    node.op = OpType::kConv2d;
+    node.name = prefix;
+    node.inputs = { input };
+    node.insize = inc;
+    node.outsize = cfg.odim;
+    node.kernel[0] = kh;
+    node.kernel[1] = kw;
+    node.stride[0] = sh;
+    node.stride[1] = sw;
+    node.weights = {
+      loader.load(prefix + ".weight", (int64_t)cfg.odim * inc * kh * kw),
+      loader.load(prefix + ".bias", cfg.odim)
+    };
+    return graph.add(node);
+  }
+
+  int PositionWise(int input, const std::string& prefix) {
+    Node node;
+    node.op = OpType::kPositionWise;
+    node.name = prefix;
+    node.inputs = { input };
+    node.outsize = cfg.odim;
+    node.maxseql = cfg.maxseql;
+    node.weights = { loader.load(prefix, (int64_t)cfg.maxseql * cfg.odim) };
+    return graph.add(node);
+  }
+
+  int FC(int input, int insize, int outsize, const std::string& prefix) {
+    Node node;
+    node.op = OpType::kFC;
+    node.name = prefix;
+    node.inputs = { input };
+    node.insize = insize;
+    node.outsize = outsize;
+    node.weights = {
+      loader.load(prefix + ".weight", (int64_t)insize * outsize),
+      loader.load(prefix + ".bias", outsize)
+    };
+    return graph.add(node);
+  }
+
+  int LayerNormalization(int input, const std::string& prefix) {
+    Node node;
+    node.op = OpType::kLayerNorm;
+    node.name = prefix;
+    node.inputs = { input };
+    node.outsize = cfg.odim;
+    node.weights = {
+      loader.load(prefix + ".weight", cfg.odim),
+      loader.load(prefix + ".bias", cfg.odim)
+    };
+    return graph.add(node);
+  }
+
+  int FeedForward(int input, const std::string& prefix) {
+    int fc1 = FC(input, cfg.odim, cfg.feed_forward, prefix + ".feed_forward.w_1");
+    int fb1 = Unary(OpType::kRelu, fc1, prefix + ".feed_forward.relu");
+    return FC(fb1, cfg.feed_forward, cfg.odim, prefix + ".feed_forward.w_2");
+  }
+
+  int SelfAttention(int input, bool mask, const std::string& prefix) {
+    int q = FC(input, cfg.odim, cfg.odim, prefix + ".self_attn.linear_q");
+    int k = FC(input, cfg.odim, cfg.odim, prefix + ".self_attn.linear_k");
+    int v = FC(input, cfg.odim, cfg.odim, prefix + ".self_attn.linear_v");
+
+    Node node;
+    node.op = OpType::kSelfAttention;
+    node.name = prefix + ".self_attn";
+    node.inputs = { q, k, v };
+    node.n_head = cfg.n_head;
+    node.outsize = cfg.odim;
+    node.mask = mask;
+    int bottom = graph.add(node);
+
+    return FC(bottom, cfg.odim, cfg.odim, prefix + ".self_attn.linear_out");
+  }
+
+  int SrcAttention(int input, int encoder, const std::string& prefix) {
+    int q = FC(input, cfg.odim, cfg.odim, prefix + ".src_attn.linear_q");
+
+    Node node;
+    node.op = OpType::kSrcAttention;
+    node.name = prefix + ".src_attn";
+    node.inputs = { q, encoder };
+    node.n_head = cfg.n_head;
+    node.insize = cfg.odim;
+    node.outsize = cfg.odim;
+    node.weights = {
+      loader.load(prefix + ".src_attn.linear_k.weight", (int64_t)cfg.odim * cfg.odim),
+      loader.load(prefix + ".src_attn.linear_k.bias", cfg.odim),
+      loader.load(prefix + ".src_attn.linear_v.weight", (int64_t)cfg.odim * cfg.odim),
+      loader.load(prefix + ".src_attn.linear_v.bias", cfg.odim)
+    };
+    int bottom = graph.add(node);
+
+    return FC(bottom, cfg.odim, cfg.odim, prefix + ".src_attn.linear_out");
+  }
+
+  // residual block: input + f(x), with the concat_linear variant when configured.
+  // f(x) is the sublayer output as in ESPnet, the old TensorRT encoder added
+  // the normalized input x instead
+  int Residual(int input, int x, int fx, const std::string& concat_prefix) {
+    if (cfg.concat_after) {
+      Node node;
+      node.op = OpType::kConcat;
+      node.name = concat_prefix + ".concat";
+      node.inputs = { x, fx };
+      int concat = graph.add(node);
+      fx = FC(concat, cfg.odim * 2, cfg.odim, concat_prefix);
+    }
+    return Add(input, fx, concat_prefix + ".residual");
+  }
+
+  int Conv2dSubsampling(int input) {
+    int conv0 = Conv2d(input, 1, 3, 3, 2, 2, cfg.path + "/encoder.embed.conv.0");
+    int act0 = Unary(OpType::kRelu, conv0, "encoder.embed.conv.1");
+    int conv1 = Conv2d(act0, cfg.odim, 3, 3, 2, 2, cfg.path + "/encoder.embed.conv.2");
+    int act1 = Unary(OpType::kRelu, conv1, "encoder.embed.conv.3");
+    int height = ((cfg.idim - 1) / 2 - 1) / 2;
+    int conv2 = Conv2d(act1, cfg.odim, height, 1, height, 1, cfg.path + "/encoder.embed.out.0");
+    int seq = Unary(OpType::kToSequence, conv2, "encoder.embed.shuffle");
+    return PositionWise(seq, cfg.path + "/encoder.embed.out.1.pe");
+  }
+
+  int Encoder_Layer(int input, const std::string& prefix) {
+    int tmp = input;
+    if (cfg.normalize_before)
+      tmp = LayerNormalization(tmp, prefix + ".norm1");
+    int self = SelfAttention(tmp, false, prefix);
+    tmp = Residual(input, tmp, self, prefix + ".concat_linear1");
+    if (!cfg.normalize_before)
+      tmp = LayerNormalization(tmp, prefix + ".norm1");
+
+    input = tmp;
+    if (cfg.normalize_before)
+      tmp = LayerNormalization(tmp, prefix + ".norm2");
+    tmp = FeedForward(tmp, prefix);
+    tmp = Add(input, tmp, prefix + ".feed_forward.residual");
+    if (!cfg.normalize_before)
+      tmp = LayerNormalization(tmp, prefix + ".norm2");
+    return tmp;
+  }
+
+  int Encoder_Layers(int input) {
+    for (int i = 0; i < cfg.encoder_layers; ++i)
+      input = Encoder_Layer(input, cfg.path + "/encoder.encoders." + std::to_string(i));
+    if (cfg.normalize_before)
+      input = LayerNormalization(input, cfg.path + "/encoder.after_norm");
+    return input;
+  }
+
+  int PositionalEncoding(int words) {
+    Node node;
+    node.op = OpType::kEmbedding;
+    node.name = cfg.path + "/decoder.embed.0";
+    node.inputs = { words };
+    node.insize = cfg.nvocab;
+    node.outsize = cfg.odim;
+    node.weights = { loader.load(node.name + ".weight", (int64_t)cfg.nvocab * cfg.odim) };
+    int gather = graph.add(node);
+    return PositionWise(gather, cfg.path + "/decoder.embed.1.pe");
+  }
+
+  int Decoder_Layer(int input, int encoder, const std::string& prefix) {
+    int tmp = input;
+    if (cfg.normalize_before)
+      tmp = LayerNormalization(tmp, prefix + ".norm1");
+    int self = SelfAttention(tmp, true, prefix);
+    tmp = Residual(input, tmp, self, prefix + ".concat_linear1");
+    if (!cfg.normalize_before)
+      tmp = LayerNormalization(tmp, prefix + ".norm1");
+
+    input = tmp;
+    if (cfg.normalize_before)
+      tmp = LayerNormalization(tmp, prefix + ".norm2");
+    int src = SrcAttention(tmp, encoder, prefix);
+    tmp = Residual(input, tmp, src, prefix + ".concat_linear2");
+    if (!cfg.normalize_before)
+      tmp = LayerNormalization(tmp, prefix + ".norm2");
+
+    input = tmp;
+    if (cfg.normalize_before)
+      tmp = LayerNormalization(tmp, prefix + ".norm3");
+    tmp = FeedForward(tmp, prefix);
+    tmp = Add(input, tmp, prefix + ".feed_forward.residual");
+    if (!cfg.normalize_before)
+      tmp = LayerNormalization(tmp, prefix + ".norm3");
+    return tmp;
+  }
+
+  int Decoder_Layers(int input, int encoder) {
+    for (int i = 0; i < cfg.decoder_layers; ++i)
+      input = Decoder_Layer(input, encoder, cfg.path + "/decoder.decoders." + std::to_string(i));
+    return input;
+  }
+
+  const ModelConfig& cfg;
+  WeightLoader& loader;
+  Graph graph;
+};
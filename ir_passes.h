@@ -0,0 +1,294 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include "ir.h"
+
+// Graph rewrites over the IR. Every pass keeps the numeric result of the
+// graph (up to float rounding) and returns the number of rewrites it made.
+
+struct PassOptions {
+  bool fuse_residual_layernorm = true;
+  bool fold_bias_relu = true;
+  bool merge_qkv = true;
+  bool pretranspose_constants = true;
+  bool eliminate_dead_outputs = true;
+  bool fuse_subsampling = true;
+  // plugin weights (SrcAttention k/v) are only pre-transposed for the CPU
+  // executor, the TensorRT plugins expect the torch [out,in] layout. The
+  // fused front end (fuse_subsampling) has no TensorRT lowering either.
+  bool cpu_target = true;
+  // when set, derived constants are made through loader->derive
+  WeightLoader* loader = nullptr;
+};
+
+Weight deriveWeight(WeightLoader* loader, const std::string& op,
+  const std::vector<Weight>& sources, const std::function<Weight()>& make) {
+  return loader ? loader->derive(op, sources, make) : make();
+}
+
+void removeNodes(Graph& graph, const std::vector<bool>& removed) {
+  std::vector<Node> kept;
+  for (int i = 0; i < (int)graph.nodes.size(); ++i)
+    if (!removed[i])
+      kept.push_back(graph.nodes[i]);
+  graph.nodes.swap(kept);
+}
+
+// value is read only by node and is not a graph output
+bool onlyUsedBy(const Graph& graph, int value, int node) {
+  auto users = graph.consumers(value);
+  return users.size() == 1 && users[0] == node && !graph.isOutput(value);
+}
+
+// FC/Conv2d followed by its only reader Relu -> FC/Conv2d with relu epilogue
+int FoldBiasRelu(Graph& graph) {
+  std::vector<bool> removed(graph.nodes.size(), false);
+  int count = 0;
+  for (int i = 0; i < (int)graph.nodes.size(); ++i) {
+    Node& relu = graph.nodes[i];
+    if (relu.op != OpType::kRelu)
+      continue;
+    int p = graph.producer(relu.inputs[0]);
+    if (p < 0 || graph.nodes[p].relu || !onlyUsedBy(graph, relu.inputs[0], i))
+      continue;
+    if (graph.nodes[p].op != OpType::kFC && graph.nodes[p].op != OpType::kConv2d)
+      continue;
+    graph.nodes[p].relu = true;
+    graph.replaceUses(relu.outputs[0], relu.inputs[0]);
+    removed[i] = true;
+    ++count;
+  }
+  removeNodes(graph, removed);
+  return count;
+}
+
+// Add followed by LayerNorm -> AddLayerNorm producing both the sum (still
+// needed as the next residual) and its normalization
+int FuseResidualLayerNorm(Graph& graph) {
+  std::vector<bool> removed(graph.nodes.size(), false);
+  int count = 0;
+  for (int i = 0; i < (int)graph.nodes.size(); ++i) {
+    Node& ln = graph.nodes[i];
+    if (ln.op != OpType::kLayerNorm)
+      continue;
+    int p = graph.producer(ln.inputs[0]);
+    if (p < 0 || graph.nodes[p].op != OpType::kAdd)
+      continue;
+    Node& add = graph.nodes[p];
+    add.op = OpType::kAddLayerNorm;
+    add.name = ln.name;
+    add.outsize = ln.outsize;
+    add.weights = ln.weights;
+    add.outputs.push_back(ln.outputs[0]);
+    removed[i] = true;
+    ++count;
+  }
+  removeNodes(graph, removed);
+  return count;
+}
+
+Weight concatWeights(const std::vector<Weight>& weights) {
+  std::vector<float> data;
+  for (auto& weight : weights)
+    data.insert(data.end(), weight.values, weight.values + weight.count);
+  return makeWeight(std::move(data));
+}
+
+// three projections of the same input feeding one SelfAttention -> one FC
+// with [3*odim,in] weights whose output the attention reads as fused qkv
+int MergeQKV(Graph& graph, WeightLoader* loader = nullptr) {
+  std::vector<bool> removed(graph.nodes.size(), false);
+  int count = 0;
+  for (int i = 0; i < (int)graph.nodes.size(); ++i) {
+    Node& attn = graph.nodes[i];
+    if (attn.op != OpType::kSelfAttention || attn.fused_qkv || attn.inputs.size() != 3)
+      continue;
+    int p[3];
+    bool ok = true;
+    for (int j = 0; j < 3; ++j) {
+      p[j] = graph.producer(attn.inputs[j]);
+      ok = ok && p[j] >= 0 && onlyUsedBy(graph, attn.inputs[j], i);
+      if (!ok)
+        break;
+      const Node& fc = graph.nodes[p[j]];
+      ok = fc.op == OpType::kFC && !fc.relu && !fc.transposed &&
+        fc.inputs[0] == graph.nodes[p[0]].inputs[0] && fc.insize == graph.nodes[p[0]].insize;
+    }
+    if (!ok)
+      continue;
+
+    std::vector<Weight> weights, biases;
+    int outsize = 0;
+    for (int j = 0; j < 3; ++j) {
+      const Node& fc = graph.nodes[p[j]];
+      weights.push_back(fc.weights[0]);
+      biases.push_back(fc.weights[1]);
+      outsize += fc.outsize;
+    }
+    Node& merged = graph.nodes[p[0]];
+    merged.name = attn.name + ".linear_qkv";
+    merged.outsize = outsize;
+    merged.weights = {
+      deriveWeight(loader, "concat", weights, [&] { return concatWeights(weights); }),
+      deriveWeight(loader, "concat", biases, [&] { return concatWeights(biases); })
+    };
+    attn.inputs = { merged.outputs[0] };
+    attn.fused_qkv = true;
+    removed[p[1]] = removed[p[2]] = true;
+    ++count;
+  }
+  removeNodes(graph, removed);
+  return count;
+}
+
+Weight transposeWeight(const Weight& weight, int rows, int cols) {
+  std::vector<float> data(weight.count);
+  for (int r = 0; r < rows; ++r)
+    for (int c = 0; c < cols; ++c)
+      data[(size_t)c * rows + r] = weight.values[(size_t)r * cols + c];
+  return makeWeight(std::move(data));
+}
+
+Weight transposeWeight(WeightLoader* loader, const Weight& weight, int rows, int cols) {
+  return deriveWeight(loader, "transpose " + std::to_string(rows) + "x" + std::to_string(cols),
+    { weight }, [&] { return transposeWeight(weight, rows, cols); });
+}
+
+// [out,in] torch weights -> [in,out] so matmuls stream contiguous rows
+int PretransposeConstants(Graph& graph, bool cpu_target, WeightLoader* loader = nullptr) {
+  int count = 0;
+  for (auto& node : graph.nodes) {
+    if (node.transposed)
+      continue;
+    if (node.op == OpType::kFC) {
+      node.weights[0] = transposeWeight(loader, node.weights[0], node.outsize, node.insize);
+      node.transposed = true;
+      ++count;
+    }
+    else if (node.op == OpType::kSrcAttention && cpu_target) {
+      node.weights[0] = transposeWeight(loader, node.weights[0], node.outsize, node.insize);
+      node.weights[2] = transposeWeight(loader, node.weights[2], node.outsize, node.insize);
+      node.transposed = true;
+      ++count;
+    }
+  }
+  return count;
+}
+
+// torch [O,C,kh,kw] -> [kw,kh,C,O], the output channel is contiguous
+Weight packConvWeight(WeightLoader* loader, const Weight& weight, int O, int C, int kh, int kw) {
+  return deriveWeight(loader, "pack_conv " + std::to_string(kh) + "x" + std::to_string(kw),
+    { weight }, [&] {
+    std::vector<float> data(weight.count);
+    for (int o = 0; o < O; ++o)
+      for (int c = 0; c < C; ++c)
+        for (int u = 0; u < kh; ++u)
+          for (int t = 0; t < kw; ++t)
+            data[(((size_t)t * kh + u) * C + c) * O + o] =
+              weight.values[(((size_t)o * C + c) * kh + u) * kw + t];
+    return makeWeight(std::move(data));
+  });
+}
+
+bool isConv(const Node& node, int kh, int kw, int sh, int sw, bool relu) {
+  return node.op == OpType::kConv2d && node.relu == relu && node.kernel[0] == kh &&
+    node.kernel[1] == kw && node.stride[0] == sh && node.stride[1] == sw;
+}
+
+// Conv2d 3x3/2 (relu) -> Conv2d 3x3/2 (relu) -> Conv2d [H,1]/[H,1] ->
+// ToSequence -> one Subsampling node, see cpuSubsamplingTile for the packed
+// weight layouts. Needs fold_bias_relu to have run.
+int FuseSubsampling(Graph& graph, WeightLoader* loader = nullptr) {
+  std::vector<bool> removed(graph.nodes.size(), false);
+  int count = 0;
+  for (int i = 0; i < (int)graph.nodes.size(); ++i) {
+    Node& seq = graph.nodes[i];
+    if (seq.op != OpType::kToSequence)
+      continue;
+    int p2 = graph.producer(seq.inputs[0]);
+    if (p2 < 0 || !onlyUsedBy(graph, seq.inputs[0], i))
+      continue;
+    const Node& out = graph.nodes[p2];
+    if (!isConv(out, out.kernel[0], 1, out.kernel[0], 1, false))
+      continue;
+    int p1 = graph.producer(out.inputs[0]);
+    if (p1 < 0 || !onlyUsedBy(graph, out.inputs[0], p2) || !isConv(graph.nodes[p1], 3, 3, 2, 2, true))
+      continue;
+    const Node& conv1 = graph.nodes[p1];
+    int p0 = graph.producer(conv1.inputs[0]);
+    if (p0 < 0 || !onlyUsedBy(graph, conv1.inputs[0], p1) || !isConv(graph.nodes[p0], 3, 3, 2, 2, true))
+      continue;
+    const Node& conv0 = graph.nodes[p0];
+    int odim = conv0.outsize;
+    int height = out.kernel[0];
+    if (conv0.insize != 1 || conv1.insize != odim || out.insize != odim ||
+      conv1.outsize != odim || out.outsize != odim)
+      continue;
+
+
+    Node fused;
+    fused.op = OpType::kSubsampling;
+    fused.name = seq.name;
+    fused.inputs = conv0.inputs;
+    fused.outputs = seq.outputs;
+    fused.insize = 1;
+    fused.outsize = odim;
+    fused.kernel[0] = height;
+    fused.weights = {
+      packConvWeight(loader, conv0.weights[0], odim, 1, 3, 3), conv0.weights[1],
+      packConvWeight(loader, conv1.weights[0], odim, odim, 3, 3), conv1.weights[1],
+      packConvWeight(loader, out.weights[0], odim, odim, height, 1), out.weights[1]
+    };
+    graph.nodes[i] = fused;
+    removed[p0] = removed[p1] = removed[p2] = true;
+    ++count;
+  }
+  removeNodes(graph, removed);
+  return count;
+}
+
+// drops nodes that do not reach a graph output and unlinks unread outputs
+int EliminateDeadOutputs(Graph& graph) {
+  std::vector<bool> live(graph.values.size(), false);
+  for (int o : graph.outputs)
+    live[o] = true;
+
+  std::vector<bool> removed(graph.nodes.size(), false);
+  int count = 0;
+  for (int i = (int)graph.nodes.size() - 1; i >= 0; --i) {
+    Node& node = graph.nodes[i];
+    bool used = false;
+    for (auto& o : node.outputs) {
+      if (o >= 0 && !live[o]) {
+        o = -1;
+        ++count;
+      }
+      used = used || o >= 0;
+    }
+    if (!used) {
+      removed[i] = true;
+      continue;
+    }
+    for (int in : node.inputs)
+      live[in] = true;
+  }
+  removeNodes(graph, removed);
+  return count;
+}
+
+void runPasses(Graph& graph, const PassOptions& options) {
+  if (options.fold_bias_relu)
+    std::cout << "[IR] fold_bias_relu: " << FoldBiasRelu(graph) << std::endl;
+  if (options.fuse_residual_layernorm)
+    std::cout << "[IR] fuse_residual_layernorm: " << FuseResidualLayerNorm(graph) << std::endl;
+  if (options.merge_qkv)
+    std::cout << "[IR] merge_qkv: " << MergeQKV(graph, options.loader) << std::endl;
+  if (options.pretranspose_constants)
+    std::cout << "[IR] pretranspose_constants: " << PretransposeConstants(graph, options.cpu_target, options.loader) << std::endl;
+  if (options.fuse_subsampling && options.cpu_target)
+    std::cout << "[IR] fuse_subsampling: " << FuseSubsampling(graph, options.loader) << std::endl;
+  if (options.eliminate_dead_outputs)
+    std::cout << "[IR] eliminate_dead_outputs: " << EliminateDeadOutputs(graph) << std::endl;
+}
@@ -0,0 +1,178 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include "ir.h"
+#include "util.h"
+#include <NvInfer.h>
+
+using namespace nvinfer1;
+
+Dims toDims(const Shape& shape) {
+  Dims dims;
+  dims.nbDims = shape.nb;
+  for (int i = 0; i < shape.nb; ++i)
+    dims.d[i] = shape.d[i];
+  return dims;
+}
+
+// Lowers an IR graph into a TensorRT network. The object owns the constants it
+// creates and must outlive the engine build, as must the graph weights.
+class TRTLowering {
+public:
+  TRTLowering(INetworkDefinition* network, DataType ctype)
+    : network(network), ctype(ctype) {}
+
+  void lower(const Graph& graph) {
+    tensors.assign(graph.values.size(), nullptr);
+    for (int in : graph.inputs) {
+      const Value& value = graph.values[in];
+      tensors[in] = network->addInput(value.name.c_str(),
+        value.is_int ? DataType::kINT32 : ctype, toDims(value.dims));
+    }
+    for (auto& node : graph.nodes)
+      lowerNode(node);
+    for (int o : graph.outputs) {
+      tensors[o]->setName(graph.values[o].name.c_str());
+      network->markOutput(*tensors[o]);
+    }
+  }
+
+private:
+  ITensor* relu(ITensor* input, bool fused) {
+    if (!fused)
+      return input;
+    return network->addActivation(*input, ActivationType::kRELU)->getOutput(0);
+  }
+
+  uint32_t lastAxis(ITensor* input) {
+    return 1U << (input->getDimensions().nbDims - 1);
+  }
+
+  // slice j of three along the last axis of a fused qkv tensor
+  ITensor* sliceQKV(ITensor* qkv, int j, int odim) {
+    Dims dims = qkv->getDimensions();
+    auto divisor = std::make_shared<std::vector<int>>(dims.nbDims, 1);
+    divisor->back() = 3;
+    constants.push_back(divisor);
+    Weights w{ DataType::kINT32, divisor->data(), (int64_t)divisor->size() };
+    Dims shape_dims;
+    shape_dims.nbDims = 1;
+    shape_dims.d[0] = dims.nbDims;
+    auto shape = network->addShape(*qkv)->getOutput(0);
+    auto div = network->addConstant(shape_dims, w)->getOutput(0);
+    auto size = network->addElementWise(*shape, *div, ElementWiseOperation::kDIV)->getOutput(0);
+
+    Dims start = dims, stride = dims;
+    for (int i = 0; i < dims.nbDims; ++i) {
+      start.d[i] = 0;
+      stride.d[i] = 1;
+    }
+    start.d[dims.nbDims - 1] = j * odim;
+    auto slice = network->addSlice(*qkv, start, dims, stride);
+    slice->setInput(2, *size);
+    return slice->getOutput(0);
+  }
+
+  void lowerNode(const Node& node) {
+    ITensor* x = tensors[node.inputs[0]];
+    ITensor* y = nullptr;
+    switch (node.op) {
+    case OpType::kConv2d: {
+      auto conv = network->addConvolutionNd(*x, node.outsize, DimsHW(node.kernel[0], node.kernel[1]),
+        toWeights(node.weights[0]), toWeights(node.weights[1]));
+      conv->setStride(DimsHW(node.stride[0], node.stride[1]));
+      y = relu(conv->getOutput(0), node.relu);
+      break;
+    }
+    case OpType::kRelu:
+      y = relu(x, true);
+      break;
+    case OpType::kToSequence: {
+      auto shuffle = network->addShuffle(*x);
+      shuffle->setFirstTranspose(Permutation{ 0, 2, 3, 1 });
+      shuffle->setReshapeDimensions(DimsHW(-1, x->getDimensions().d[1]));
+      y = shuffle->getOutput(0);
+      break;
+    }
+    case OpType::kPositionWise:
+      y = PositionWise(network, x, node.maxseql, node.outsize, ctype, toWeights(node.weights[0]));
+      break;
+    case OpType::kEmbedding: {
+      auto embedding = network->addConstant(DimsHW(node.insize, node.outsize), toWeights(node.weights[0]))->getOutput(0);
+      y = network->addGather(*embedding, *x, 0)->getOutput(0);
+      break;
+    }
+    case OpType::kFC:
+      y = relu(FC(network, x, node.insize, node.outsize, toWeights(node.weights[0]),
+        toWeights(node.weights[1]), node.transposed), node.relu);
+      break;
+    case OpType::kLayerNorm:
+      y = LayerNormalization(network, x, toWeights(node.weights[0]), toWeights(node.weights[1]));
+      break;
+    case OpType::kAdd:
+    case OpType::kAddLayerNorm: {
+      auto sum = network->addElementWise(*x, *tensors[node.inputs[1]], ElementWiseOperation::kSUM)->getOutput(0);
+      y = sum;
+      if (node.op == OpType::kAddLayerNorm)
+        tensors[node.outputs[1]] = LayerNormalization(network, sum,
+          toWeights(node.weights[0]), toWeights(node.weights[1]));
+      break;
+    }
+    case OpType::kSelfAttention:
+      if (node.fused_qkv)
+        y = SelfAttention(network, sliceQKV(x, 0, node.outsize), sliceQKV(x, 1, node.outsize),
+          sliceQKV(x, 2, node.outsize), node.n_head, node.outsize, node.mask);
+      else
+        y = SelfAttention(network, x, tensors[node.inputs[1]], tensors[node.inputs[2]],
+          node.n_head, node.outsize, node.mask);
+      break;
+    case OpType::kSrcAttention:
+      y = SrcAttention(network, x, tensors[node.inputs[1]], node.n_head, node.outsize, ctype,
+        toWeights(node.weights[0]), toWeights(node.weights[1]),
+        toWeights(node.weights[2]), toWeights(node.weights[3]));
+      break;
+    case OpType::kConcat: {
+      std::vector<ITensor*> vit;
+      for (int i : node.inputs)
+        vit.push_back(tensors[i]);
+      auto concat = network->addConcatenation(vit.data(), vit.size());
+      concat->setAxis(x->getDimensions().nbDims - 1);
+      y = concat->getOutput(0);
+      break;
+    }
+    case OpType::kFinalSlice: {
+      int odim = x->getDimensions().d[x->getDimensions().nbDims - 1];
+      auto shuffle = network->addShuffle(*FinalSlice(network, x));
+      shuffle->setReshapeDimensions(DimsHW(1, odim));
+      y = shuffle->getOutput(0);
+      break;
+    }
+    case OpType::kSoftmax: {
+      auto softmax = network->addSoftMax(*x);
+      softmax->setAxes(lastAxis(x));
+      y = softmax->getOutput(0);
+      break;
+    }
+    case OpType::kLog:
+      y = network->addUnary(*x, UnaryOperation::kLOG)->getOutput(0);
+      break;
+    case OpType::kTopK: {
+      auto topk = network->addTopK(*x, TopKOperation::kMAX, node.topk, lastAxis(x));
+      y = topk->getOutput(0);
+      if (node.outputs[1] >= 0)
+        tensors[node.outputs[1]] = topk->getOutput(1);
+      break;
+    }
+    default:
+      break;
+    }
+    if (node.outputs[0] >= 0)
+      tensors[node.outputs[0]] = y;
+  }
+
+  INetworkDefinition* network;
+  DataType ctype;
+  std::vector<ITensor*> tensors;
+  std::vector<std::shared_ptr<std::vector<int>>> constants;
+};
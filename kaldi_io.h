@@ -0,0 +1,229 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// Read only memory mapping of a whole file.
+class MappedFile {
+public:
+  MappedFile(const std::string& file) {
+#ifdef _WIN32
+    handle = CreateFileA(file.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+      OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (handle == INVALID_HANDLE_VALUE) {
+      std::cout << file << " open fail!" << std::endl;
+      exit(0);
+    }
+    LARGE_INTEGER len;
+    GetFileSizeEx(handle, &len);
+    length = (size_t)len.QuadPart;
+    mapping = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+    base = mapping ? (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+#else
+    fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0) {
+      std::cout << file << " open fail!" << std::endl;
+      exit(0);
+    }
+    struct stat st;
+    fstat(fd, &st);
+    length = (size_t)st.st_size;
+    void* p = length ? mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    base = p == MAP_FAILED ? nullptr : (const char*)p;
+#endif
+    if (!base && length) {
+      std::cout << file << " mmap fail!" << std::endl;
+      exit(0);
+    }
+  }
+
+  ~MappedFile() {
+#ifdef _WIN32
+    if (base)
+      UnmapViewOfFile(base);
+    if (mapping)
+      CloseHandle(mapping);
+    CloseHandle(handle);
+#else
+    if (base)
+      munmap((void*)base, length);
+    close(fd);
+#endif
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const char* data() const { return base; }
+  size_t size() const { return length; }
+
+private:
+#ifdef _WIN32
+  HANDLE handle = INVALID_HANDLE_VALUE;
+  HANDLE mapping = NULL;
+#else
+  int fd = -1;
+#endif
+  const char* base = nullptr;
+  size_t length = 0;
+};
+
+struct Utterance {
+  std::string key;
+  std::string ark;
+  size_t offset = 0;
+  int frames = 0;
+  int dim = 0;
+};
+
+// "utt /path/feats.ark:1234" lines of a Kaldi feats.scp
+std::vector<Utterance> readScp(const std::string& scp) {
+  std::ifstream ifs(scp);
+  if (ifs.fail()) {
+    std::cout << scp << " open fail!" << std::endl;
+    exit(0);
+  }
+  std::vector<Utterance> utts;
+  std::string line;
+  while (std::getline(ifs, line)) {
+    std::istringstream iss(line);
+    Utterance utt;
+    std::string rspec;
+    if (!(iss >> utt.key >> rspec))
+      continue;
+    size_t colon = rspec.rfind(':');
+    if (colon == std::string::npos) {
+      std::cerr << "unsupported scp entry: " << line << std::endl;
+      exit(0);
+    }
+    utt.ark = rspec.substr(0, colon);
+    std::string offset = rspec.substr(colon + 1);
+    bool valid = !offset.empty() && offset.find_first_not_of("0123456789") == std::string::npos;
+    try {
+      if (valid)
+        utt.offset = std::stoull(offset);
+    }
+    catch (const std::exception&) {
+      valid = false;
+    }
+    if (!valid) {
+      std::cerr << "bad ark offset in scp entry: " << line << std::endl;
+      exit(0);
+    }
+    utts.push_back(utt);
+  }
+  return utts;
+}
+
+// Kaldi binary matrix inside a mapped ark, the data is not copied
+struct MatrixView {
+  const char* data = nullptr;
+  int rows = 0;
+  int cols = 0;
+  bool is_double = false;
+
+  float at(int r, int c) const {
+    size_t i = (size_t)r * cols + c;
+    if (is_double) {
+      double v;
+      memcpy(&v, data + i * sizeof(double), sizeof(double));
+      return (float)v;
+    }
+    float v;
+    memcpy(&v, data + i * sizeof(float), sizeof(float));
+    return v;
+  }
+};
+
+// Maps every ark once and serves matrices straight out of the mappings.
+class ArkReader {
+public:
+  MatrixView read(const Utterance& utt) {
+    std::shared_ptr<MappedFile> file = open(utt.ark);
+    if (utt.offset > file->size() || file->size() - utt.offset < 15) {
+      std::cerr << utt.key << ": offset " << utt.offset << " is past the end of " << utt.ark << std::endl;
+      exit(0);
+    }
+    const char* p = file->data() + utt.offset;
+    const char* end = file->data() + file->size();
+    MatrixView view;
+    if (p[0] != '\0' || p[1] != 'B') {
+      std::cerr << utt.key << ": only binary Kaldi matrices are supported" << std::endl;
+      exit(0);
+    }
+    p += 2;
+    if (!memcmp(p, "FM ", 3))
+      view.is_double = false;
+    else if (!memcmp(p, "DM ", 3))
+      view.is_double = true;
+    else {
+      std::cerr << utt.key << ": unsupported matrix type (compressed?)" << std::endl;
+      exit(0);
+    }
+    p += 3;
+    int32_t rows, cols;
+    if (p[0] != 4 || p[5] != 4) {
+      std::cerr << utt.key << ": corrupted matrix header" << std::endl;
+      exit(0);
+    }
+    memcpy(&rows, p + 1, 4);
+    memcpy(&cols, p + 6, 4);
+    p += 10;
+    if (rows < 0 || cols < 0) {
+      std::cerr << utt.key << ": corrupted matrix header" << std::endl;
+      exit(0);
+    }
+    // compared in elements, rows * cols * 8 could wrap
+    if ((uint64_t)rows * (uint64_t)cols > (uint64_t)(end - p) / (view.is_double ? 8 : 4)) {
+      std::cerr << utt.key << ": truncated matrix" << std::endl;
+      exit(0);
+    }
+    view.rows = rows;
+    view.cols = cols;
+    view.data = p;
+    return view;
+  }
+
+  // fills frames/dim of every utterance from the matrix headers only
+  void probe(std::vector<Utterance>& utts) {
+    for (auto& utt : utts) {
+      MatrixView view = read(utt);
+      utt.frames = view.rows;
+      utt.dim = view.cols;
+    }
+  }
+
+private:
+  std::shared_ptr<MappedFile> open(const std::string& ark) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = files.find(ark);
+    if (it != files.end())
+      return it->second;
+    auto file = std::make_shared<MappedFile>(ark);
+    files[ark] = file;
+    return file;
+  }
+
+  std::mutex lock;
+  std::map<std::string, std::shared_ptr<MappedFile>> files;
+};
@@ -1,6 +1,7 @@
 
 #include "Espnet_TRT_Transformer_Encoder.h"
 #include "Espnet_TRT_Transformer_Decoder.h"
+#include "cpu_executor.h"
 
 #ifndef TEST
 
@@ -33,7 +34,9 @@ int main(int argc,char**argv) {
       << "--batchsize [the max batchsize of decoder, default 16]" << std::endl
       << "--topk [the topk in each decoder step, default 16]" << std::endl
       << "--maxseql [the max sequence length of encoder, default 500]" << std::endl
-      << "--model_name [the output trt model name, default asr]" << std::endl;
+      << "--model_name [the output trt model name, default asr]" << std::endl
+      << "--verify_ir [check the IR passes on CPU before building, default false]" << std::endl
+      << "--ctc_draft [also build the all positions decoder for CTC draft decoding, default false]" << std::endl;
   }
   std::map<std::string, std::string> configure{
     {"--path","asr"},
@@ -50,7 +53,9 @@ int main(int argc,char**argv) {
     {"--batchsize","16"},
     {"--topk","16"},
     {"--maxseql","5000"},
-    {"--model_name","asr"}
+    {"--model_name","asr"},
+    {"--verify_ir","false"},
+    {"--ctc_draft","false"}
   };
 
   for (int i = 1; i < argc; i += 2) {
@@ -74,12 +79,26 @@ int main(int argc,char**argv) {
     std::cout << "To see more information by running program without option input!" << std::endl;
   }
 
+  if (configure["--verify_ir"] == "true") {
+    std::cout << "verifying IR passes on CPU ..." << std::endl;
+    FileWeightLoader loader;
+    if (!verifyPasses(parseConfig(configure), loader)) {
+      std::cerr << "IR passes changed the model output!" << std::endl;
+      exit(0);
+    }
+  }
+
   std::cout << "building encoder model ..." << std::endl;
   Espnet_TRT_Transformer_Encoder(configure);
 
   std::cout << "building decoder model ..." << std::endl;
   Espnet_TRT_Transformer_Decoder(configure);
 
+  if (configure["--ctc_draft"] == "true") {
+    std::cout << "building all positions decoder model ..." << std::endl;
+    Espnet_TRT_Transformer_Decoder(configure, true);
+  }
+
   return 0;
 
 }
\ No newline at end of file
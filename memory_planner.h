@@ -0,0 +1,154 @@
+#pragma once
+
+#include <map>
+#include <vector>
+#include <cstdint>
+#include <iostream>
+#include <algorithm>
+#include "ir.h"
+#include "cpu_kernels.h"
+
+// Static activation memory planning for the CPU executor. Every intermediate
+// value and every kernel scratch buffer gets a fixed offset in one arena,
+// tensors whose lifetimes do not overlap share bytes. The plan is made once
+// for the max profile shapes, any smaller input fits the same offsets.
+
+const int64_t kArenaAlignment = 64;
+
+int64_t alignUp(int64_t bytes) {
+  return (bytes + kArenaAlignment - 1) / kArenaAlignment * kArenaAlignment;
+}
+
+// scratch bytes a node needs besides its outputs, kernels that split their
+// work over threads get one slice per thread
+int64_t workspaceBytes(const Node& node, const std::vector<Shape>& shapes, int threads = 1) {
+  const Shape& in = shapes[node.inputs[0]];
+  switch (node.op) {
+  case OpType::kSelfAttention:
+    return in.rows() * sizeof(float);
+  case OpType::kSrcAttention: {
+    int64_t S = shapes[node.inputs[1]].rows();
+    return (2 * S * node.outsize + S) * sizeof(float);
+  }
+  case OpType::kTopK:
+    return in.last() * sizeof(int);
+  case OpType::kSubsampling:
+    return threads * subsamplingScratch(in.d[2], node.outsize, kSubsamplingTile) * sizeof(float);
+  default:
+    return 0;
+  }
+}
+
+struct MemoryPlan {
+  std::vector<int64_t> offsets;   // per value, -1 for graph inputs / unused
+  std::vector<int64_t> sizes;     // per value, planned bytes
+  std::vector<int64_t> workspace; // per node, -1 when no scratch is needed
+  std::vector<int64_t> workspace_sizes;
+  int64_t peak = 0;               // arena bytes
+  int64_t naive = 0;              // one buffer per tensor
+};
+
+MemoryPlan planMemory(const Graph& graph, const std::map<std::string, Shape>& max_shapes, int threads = 1) {
+  std::vector<Shape> shapes = inferShapes(graph, max_shapes);
+  int nnodes = (int)graph.nodes.size();
+
+  // a buffer lives from the node producing it to its last reader, graph
+  // outputs stay live until the end of the run
+  struct Interval { int begin, end; int64_t bytes; int value, node; };
+  std::vector<Interval> intervals;
+  std::vector<int> last_use(graph.values.size(), -1);
+  for (int i = 0; i < nnodes; ++i)
+    for (int in : graph.nodes[i].inputs)
+      last_use[in] = i;
+  for (int o : graph.outputs)
+    last_use[o] = nnodes;
+
+  for (int i = 0; i < nnodes; ++i) {
+    const Node& node = graph.nodes[i];
+    for (int o : node.outputs)
+      if (o >= 0)
+        intervals.push_back({ i, std::max(i, last_use[o]), alignUp(shapes[o].count() * 4), o, -1 });
+    int64_t ws = workspaceBytes(node, shapes, threads);
+    if (ws > 0)
+      intervals.push_back({ i, i, alignUp(ws), -1, i });
+  }
+
+  // greedy by size: biggest first, each at the lowest offset that does not
+  // collide with an already placed buffer alive at the same time
+  std::vector<int> order(intervals.size());
+  for (int i = 0; i < (int)order.size(); ++i)
+    order[i] = i;
+  std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+    return intervals[a].bytes > intervals[b].bytes;
+  });
+
+  MemoryPlan plan;
+  plan.offsets.assign(graph.values.size(), -1);
+  plan.sizes.assign(graph.values.size(), 0);
+  plan.workspace.assign(nnodes, -1);
+  plan.workspace_sizes.assign(nnodes, 0);
+  std::vector<int64_t> placed(intervals.size(), -1);
+  std::vector<int> done;
+  for (int idx : order) {
+    const Interval& cur = intervals[idx];
+    std::vector<std::pair<int64_t, int64_t>> busy;
+    for (int j : done) {
+      const Interval& other = intervals[j];
+      if (other.begin <= cur.end && cur.begin <= other.end)
+        busy.push_back({ placed[j], placed[j] + other.bytes });
+    }
+    std::sort(busy.begin(), busy.end());
+    int64_t offset = 0;
+    for (auto& range : busy) {
+      if (offset + cur.bytes <= range.first)
+        break;
+      offset = std::max(offset, range.second);
+    }
+    placed[idx] = offset;
+    done.push_back(idx);
+
+    plan.peak = std::max(plan.peak, offset + cur.bytes);
+    plan.naive += cur.bytes;
+    if (cur.value >= 0) {
+      plan.offsets[cur.value] = offset;
+      plan.sizes[cur.value] = cur.bytes;
+    }
+    else {
+      plan.workspace[cur.node] = offset;
+      plan.workspace_sizes[cur.node] = cur.bytes;
+    }
+  }
+  return plan;
+}
+
+void logMemoryPlan(const MemoryPlan& plan, const std::string& name) {
+  std::cout << "[MEM] " << name << " arena " << plan.peak / 1048576.0 << " MB, naive "
+    << plan.naive / 1048576.0 << " MB (" << (plan.naive ? 100.0 * plan.peak / plan.naive : 0.0)
+    << "%)" << std::endl;
+}
+
+// One aligned block of bytes, allocated once per executor.
+class Arena {
+public:
+  void reserve(int64_t bytes) {
+    storage.assign(bytes + kArenaAlignment, 0);
+    uintptr_t p = (uintptr_t)storage.data();
+    base = (char*)((p + kArenaAlignment - 1) / kArenaAlignment * kArenaAlignment);
+  }
+
+  char* at(int64_t offset) { return base + offset; }
+  bool reserved() const { return base != nullptr; }
+
+private:
+  std::vector<char> storage;
+  char* base = nullptr;
+};
+
+// max profile shapes, these follow the TensorRT optimization profiles
+std::map<std::string, Shape> maxEncoderShapes(const ModelConfig& cfg) {
+  return { { "data", Shape{ 1, 1, cfg.idim, 6000 } } };
+}
+
+std::map<std::string, Shape> maxDecoderShapes(const ModelConfig& cfg) {
+  return { { "words", Shape{ 192 } }, { "encoder", Shape{ 1600, cfg.odim } } };
+}
@@ -0,0 +1,294 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <algorithm>
+#include <condition_variable>
+#include "pipeline.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Production metrics of the decoding pipeline: latency histograms and
+// counters. Every thread writes its own shard without locks or atomic read
+// modify write (one writer per cell), a snapshot merges the shards on demand.
+// Metrics are declared before the first record; recording costs a bucket
+// index and three relaxed stores.
+
+// Log linear buckets as in HdrHistogram: values below 32 are exact, above
+// every power of two is split into 32 buckets, about 3% relative error.
+const int kHistogramSubBits = 5;
+const int kHistogramSub = 1 << kHistogramSubBits;
+const int kHistogramBuckets = (64 - kHistogramSubBits + 1) * kHistogramSub;
+
+int highestBit(uint64_t v) {
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanReverse64(&index, v);
+  return (int)index;
+#else
+  return 63 - __builtin_clzll(v);
+#endif
+}
+
+int histogramBucket(uint64_t v) {
+  if (v < (uint64_t)kHistogramSub)
+    return (int)v;
+  int shift = highestBit(v) - kHistogramSubBits;
+  return (shift + 1) * kHistogramSub + (int)((v >> shift) - kHistogramSub);
+}
+
+// middle of the bucket's value range
+double histogramValue(int bucket) {
+  if (bucket < kHistogramSub)
+    return bucket;
+  int shift = bucket / kHistogramSub - 1;
+  double lower = (double)((uint64_t)(kHistogramSub + bucket % kHistogramSub) << shift);
+  return lower + (double)((uint64_t)1 << shift) / 2;
+}
+
+struct HistogramSnapshot {
+  std::string name;
+  uint64_t count = 0;
+  double sum = 0.0;
+  uint64_t max = 0;
+  std::vector<uint64_t> buckets;
+
+  double mean() const { return count ? sum / count : 0.0; }
+
+  double percentile(double p) const {
+    if (!count)
+      return 0.0;
+    uint64_t rank = (uint64_t)(p / 100.0 * (count - 1)) + 1, seen = 0;
+    for (int b = 0; b < (int)buckets.size(); ++b) {
+      seen += buckets[b];
+      if (seen >= rank)
+        return std::min(histogramValue(b), (double)max);
+    }
+    return (double)max;
+  }
+};
+
+struct MetricsSnapshot {
+  double seconds = 0.0; // since the registry was made
+  std::vector<HistogramSnapshot> histograms;
+  std::vector<std::pair<std::string, uint64_t>> counters;
+  std::vector<std::pair<std::string, double>> ratios;
+
+  // one metric per line, latencies in ms, counters with their rate per second
+  void write(std::ostream& os) const {
+    os << std::fixed << std::setprecision(3);
+    os << "uptime_s " << seconds << "\n";
+    for (auto& h : histograms)
+      os << "histogram " << h.name << "_ms count " << h.count << " mean " << h.mean() / 1e6
+        << " p50 " << h.percentile(50) / 1e6 << " p90 " << h.percentile(90) / 1e6
+        << " p99 " << h.percentile(99) / 1e6 << " p99.9 " << h.percentile(99.9) / 1e6
+        << " max " << h.max / 1e6 << "\n";
+    for (auto& c : counters)
+      os << "counter " << c.first << " " << c.second << " per_s " << (seconds > 0 ? c.second / seconds : 0.0) << "\n";
+    for (auto& r : ratios)
+      os << "ratio " << r.first << " " << r.second << "\n";
+    os.unsetf(std::ios::floatfield);
+  }
+};
+
+class Metrics {
+public:
+  Metrics() : id(next_id()++), start(nowNs()) {}
+
+  // latencies in ns
+  int histogram(const std::string& name) {
+    histograms.push_back(name);
+    return (int)histograms.size() - 1;
+  }
+
+  int counter(const std::string& name) {
+    counters.push_back(name);
+    return (int)counters.size() - 1;
+  }
+
+  // numerator / denominator of two counters, computed in snapshots
+  void ratio(const std::string& name, int numerator, int denominator, double scale = 1.0) {
+    ratios.push_back({ name, numerator, denominator, scale });
+  }
+
+  void record(int histogram, int64_t ns) {
+    Shard& shard = local();
+    uint64_t v = ns > 0 ? (uint64_t)ns : 0;
+    std::atomic<uint64_t>* cells = shard.cells.get() + (size_t)histogram * kHistogramCells;
+    bump(cells[histogramBucket(v)], 1);
+    bump(cells[kHistogramBuckets], v);
+    if (v > cells[kHistogramBuckets + 1].load(std::memory_order_relaxed))
+      cells[kHistogramBuckets + 1].store(v, std::memory_order_relaxed);
+  }
+
+  void add(int counter, int64_t n = 1) {
+    Shard& shard = local();
+    bump(shard.cells[histograms.size() * kHistogramCells + counter], (uint64_t)n);
+  }
+
+  MetricsSnapshot snapshot() {
+    MetricsSnapshot snap;
+    snap.seconds = (nowNs() - start) / 1e9;
+    snap.histograms.resize(histograms.size());
+    for (size_t h = 0; h < histograms.size(); ++h) {
+      snap.histograms[h].name = histograms[h];
+      snap.histograms[h].buckets.assign(kHistogramBuckets, 0);
+    }
+    std::vector<uint64_t> totals(counters.size(), 0);
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto& kv : shards) {
+      const std::atomic<uint64_t>* cells = kv.second->cells.get();
+      for (size_t h = 0; h < histograms.size(); ++h) {
+        HistogramSnapshot& s = snap.histograms[h];
+        const std::atomic<uint64_t>* hc = cells + h * kHistogramCells;
+        for (int b = 0; b < kHistogramBuckets; ++b) {
+          uint64_t n = hc[b].load(std::memory_order_relaxed);
+          s.buckets[b] += n;
+          s.count += n;
+        }
+        s.sum += (double)hc[kHistogramBuckets].load(std::memory_order_relaxed);
+        s.max = std::max(s.max, hc[kHistogramBuckets + 1].load(std::memory_order_relaxed));
+      }
+      for (size_t c = 0; c < counters.size(); ++c)
+        totals[c] += cells[histograms.size() * kHistogramCells + c].load(std::memory_order_relaxed);
+    }
+    for (size_t c = 0; c < counters.size(); ++c)
+      snap.counters.push_back({ counters[c], totals[c] });
+    for (auto& r : ratios)
+      snap.ratios.push_back({ r.name, totals[r.denominator] ? r.scale * totals[r.numerator] / totals[r.denominator] : 0.0 });
+    return snap;
+  }
+
+  // written to file.tmp and renamed, readers never see half a snapshot
+  void dump(const std::string& file) {
+    {
+      std::ofstream ofs(file + ".tmp");
+      if (ofs.fail()) {
+        std::cerr << file << ".tmp open fail!" << std::endl;
+        return;
+      }
+      snapshot().write(ofs);
+    }
+#ifdef _WIN32
+    std::remove(file.c_str());
+#endif
+    std::rename((file + ".tmp").c_str(), file.c_str());
+  }
+
+private:
+  static const int kHistogramCells = kHistogramBuckets + 2; // buckets, sum, max
+
+  struct Shard {
+    std::unique_ptr<std::atomic<uint64_t>[]> cells;
+  };
+
+  struct Ratio {
+    std::string name;
+    int numerator;
+    int denominator;
+    double scale;
+  };
+
+  static std::atomic<uint64_t>& next_id() {
+    static std::atomic<uint64_t> id{ 0 };
+    return id;
+  }
+
+  // the only writer of a cell is its thread, a plain load and store is enough
+  static void bump(std::atomic<uint64_t>& cell, uint64_t n) {
+    cell.store(cell.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+  // the calling thread's shard, cached per thread for the last registry used
+  Shard& local() {
+    static thread_local uint64_t cached_id = ~0ull;
+    static thread_local Shard* cached = nullptr;
+    if (cached_id == id)
+      return *cached;
+    std::lock_guard<std::mutex> guard(lock);
+    std::unique_ptr<Shard>& shard = shards[std::this_thread::get_id()];
+    if (!shard) {
+      size_t cells = histograms.size() * kHistogramCells + counters.size();
+      shard.reset(new Shard());
+      shard->cells.reset(new std::atomic<uint64_t>[cells]);
+      for (size_t i = 0; i < cells; ++i)
+        shard->cells[i].store(0, std::memory_order_relaxed);
+    }
+    cached_id = id;
+    cached = shard.get();
+    return *cached;
+  }
+
+  const uint64_t id;
+  const int64_t start;
+  std::vector<std::string> histograms;
+  std::vector<std::string> counters;
+  std::vector<Ratio> ratios;
+  std::mutex lock;
+  std::map<std::thread::id, std::unique_ptr<Shard>> shards;
+};
+
+// Rewrites a snapshot file every interval until stopped, the file is the
+// text endpoint a monitoring agent scrapes. A final snapshot is written on stop.
+class MetricsDumper {
+public:
+  MetricsDumper(Metrics& metrics, const std::string& file, double interval_seconds)
+    : metrics(metrics), file(file) {
+    if (file.empty())
+      return;
+    worker = std::thread([this, interval_seconds] {
+      std::unique_lock<std::mutex> guard(lock);
+      while (!stop) {
+        if (interval_seconds > 0)
+          cv.wait_for(guard, std::chrono::duration<double>(interval_seconds), [this] { return stop; });
+        else
+          cv.wait(guard, [this] { return stop; });
+        this->metrics.dump(this->file);
+      }
+    });
+  }
+
+  ~MetricsDumper() {
+    if (!worker.joinable())
+      return;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      stop = true;
+    }
+    cv.notify_all();
+    worker.join();
+  }
+
+private:
+  Metrics& metrics;
+  std::string file;
+  std::thread worker;
+  std::mutex lock;
+  std::condition_variable cv;
+  bool stop = false;
+};
+
+// Times a scope into a histogram.
+class ScopedLatency {
+public:
+  ScopedLatency(Metrics& metrics, int histogram)
+    : metrics(metrics), histogram(histogram), begin(nowNs()) {}
+  ~ScopedLatency() { metrics.record(histogram, nowNs() - begin); }
+
+private:
+  Metrics& metrics;
+  int histogram;
+  int64_t begin;
+};
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include "ir.h"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sched.h>
+#include <pthread.h>
+#endif
+
+// NUMA topology and placement for the CPU backend. Workers are pinned to the
+// cpus of one node and run on weights replicated on that node, so the large
+// feed_forward / output_layer matmuls read local memory only.
+
+struct NumaNode {
+  int id = 0;
+  std::vector<int> cpus; // empty: the threads of this node are not pinned
+};
+
+// "0-3,8-11" -> 0 1 2 3 8 9 10 11
+std::vector<int> parseCpuList(const std::string& list) {
+  std::vector<int> cpus;
+  std::stringstream ss(list);
+  std::string range;
+  while (std::getline(ss, range, ',')) {
+    if (range.find_first_of("0123456789") == std::string::npos)
+      continue;
+    size_t dash = range.find('-');
+    int lo = std::stoi(range.substr(0, dash));
+    int hi = dash == std::string::npos ? lo : std::stoi(range.substr(dash + 1));
+    for (int c = lo; c <= hi; ++c)
+      cpus.push_back(c);
+  }
+  return cpus;
+}
+
+// nodes with the cpus this process may run on, one node holding every
+// allowed cpu when the system reports nothing
+std::vector<NumaNode> numaTopology() {
+  std::vector<NumaNode> nodes;
+#ifdef _WIN32
+  ULONG highest = 0;
+  if (GetNumaHighestNodeNumber(&highest)) {
+    for (ULONG n = 0; n <= highest; ++n) {
+      ULONGLONG mask = 0;
+      if (!GetNumaNodeProcessorMask((UCHAR)n, &mask) || !mask)
+        continue;
+      NumaNode node;
+      node.id = (int)n;
+      for (int c = 0; c < 64; ++c)
+        if (mask >> c & 1)
+          node.cpus.push_back(c);
+      nodes.push_back(node);
+    }
+  }
+#else
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  bool restricted = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+  std::ifstream online("/sys/devices/system/node/online");
+  std::string list;
+  if (online >> list) {
+    for (int id : parseCpuList(list)) {
+      std::ifstream ifs("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist");
+      std::string cpus;
+      if (!(ifs >> cpus))
+        continue;
+      NumaNode node;
+      node.id = id;
+      for (int c : parseCpuList(cpus))
+        if (!restricted || (c < CPU_SETSIZE && CPU_ISSET(c, &allowed)))
+          node.cpus.push_back(c);
+      if (!node.cpus.empty())
+        nodes.push_back(node);
+    }
+  }
+  if (nodes.empty() && restricted) {
+    NumaNode node;
+    for (int c = 0; c < CPU_SETSIZE; ++c)
+      if (CPU_ISSET(c, &allowed))
+        node.cpus.push_back(c);
+    if (!node.cpus.empty())
+      nodes.push_back(node);
+  }
+#endif
+  if (nodes.empty()) {
+    NumaNode node;
+    for (int c = 0; c < (int)std::max(1u, std::thread::hardware_concurrency()); ++c)
+      node.cpus.push_back(c);
+    nodes.push_back(node);
+  }
+  return nodes;
+}
+
+// the cpus of nodes dealt into n logical nodes, lets the per node replicas
+// and routing be exercised on a single socket machine
+std::vector<NumaNode> splitTopology(const std::vector<NumaNode>& nodes, int n) {
+  std::vector<int> cpus;
+  for (auto& node : nodes)
+    cpus.insert(cpus.end(), node.cpus.begin(), node.cpus.end());
+  n = std::max(1, n);
+  std::vector<NumaNode> split(n);
+  for (int i = 0; i < n; ++i)
+    split[i].id = i;
+  // contiguous blocks keep sibling cpus on the same logical node
+  for (size_t i = 0; i < cpus.size(); ++i)
+    split[i * n / cpus.size()].cpus.push_back(cpus[i]);
+  for (auto& node : split)
+    if (node.cpus.empty())
+      node.cpus.push_back(cpus[node.id % cpus.size()]);
+  return split;
+}
+
+void logTopology(const std::vector<NumaNode>& nodes) {
+  for (auto& node : nodes) {
+    std::cout << "[NUMA] node " << node.id << ":";
+    if (node.cpus.empty())
+      std::cout << " unpinned";
+    for (int c : node.cpus)
+      std::cout << " " << c;
+    std::cout << std::endl;
+  }
+}
+
+// pins the calling thread to one cpu
+bool pinThread(int cpu) {
+#ifdef _WIN32
+  return cpu < 64 && SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu) != 0;
+#else
+  if (cpu >= CPU_SETSIZE)
+    return false;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#endif
+}
+
+// Copy of graph whose weights are allocated and written by a thread pinned
+// to node, with the default first touch policy the pages end up in its local
+// memory. copies maps original to replicated weights, graphs replicated with
+// the same map keep sharing what they shared before.
+Graph replicateWeights(const Graph& graph, const NumaNode& node, std::map<const float*, Weight>& copies) {
+  Graph replica = graph;
+  std::thread worker([&] {
+    if (!node.cpus.empty())
+      pinThread(node.cpus[0]);
+    for (auto& n : replica.nodes)
+      for (auto& weight : n.weights) {
+        auto it = copies.find(weight.values);
+        if (it == copies.end())
+          it = copies.insert({ weight.values,
+            makeWeight(std::vector<float>(weight.values, weight.values + weight.count)) }).first;
+        weight = it->second;
+      }
+  });
+  worker.join();
+  return replica;
+}
+
+Graph replicateWeights(const Graph& graph, const NumaNode& node) {
+  std::map<const float*, Weight> copies;
+  return replicateWeights(graph, node, copies);
+}
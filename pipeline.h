@@ -0,0 +1,129 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <cstdint>
+#include <iostream>
+#include <condition_variable>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+// Building blocks of the offline decoding pipeline in corpus_decoder.h.
+
+// Blocking FIFO with a fixed capacity, push waits while it is full.
+template <typename T>
+class BoundedQueue {
+public:
+  BoundedQueue(size_t capacity) : capacity(capacity) {}
+
+  void push(T item) {
+    std::unique_lock<std::mutex> guard(lock);
+    not_full.wait(guard, [this] { return items.size() < capacity; });
+    items.push_back(std::move(item));
+    not_empty.notify_one();
+  }
+
+  // false once the queue is closed and drained
+  bool pop(T& item) {
+    std::unique_lock<std::mutex> guard(lock);
+    not_empty.wait(guard, [this] { return !items.empty() || closed; });
+    if (items.empty())
+      return false;
+    item = std::move(items.front());
+    items.pop_front();
+    not_full.notify_one();
+    return true;
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> guard(lock);
+    closed = true;
+    not_empty.notify_all();
+  }
+
+private:
+  size_t capacity;
+  bool closed = false;
+  std::deque<T> items;
+  std::mutex lock;
+  std::condition_variable not_full;
+  std::condition_variable not_empty;
+};
+
+// Counts the segments in flight between the reader and the writer.
+class Semaphore {
+public:
+  Semaphore(int count) : count(count) {}
+
+  void acquire() {
+    std::unique_lock<std::mutex> guard(lock);
+    cv.wait(guard, [this] { return count > 0; });
+    --count;
+  }
+
+  void release() {
+    std::lock_guard<std::mutex> guard(lock);
+    ++count;
+    cv.notify_one();
+  }
+
+private:
+  int count;
+  std::mutex lock;
+  std::condition_variable cv;
+};
+
+int64_t nowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// CPU time of the calling thread, unlike nowNs it does not advance while the
+// thread is descheduled for other workers
+int64_t threadCpuNs() {
+#ifdef _WIN32
+  FILETIME creation, exit, kernel, user;
+  GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user);
+  return ((int64_t)kernel.dwHighDateTime << 32 | kernel.dwLowDateTime) * 100 +
+    ((int64_t)user.dwHighDateTime << 32 | user.dwLowDateTime) * 100;
+#else
+  timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+// Per stage throughput: items, work units (frames, tokens, ...) and the
+// summed busy time of all threads running the stage.
+struct StageCounter {
+  std::string name;
+  std::string unit;
+  std::atomic<int64_t> items{ 0 };
+  std::atomic<int64_t> units{ 0 };
+  std::atomic<int64_t> busy_ns{ 0 };
+
+  StageCounter(const std::string& name, const std::string& unit) : name(name), unit(unit) {}
+
+  void add(int64_t n, int64_t begin_ns) {
+    items++;
+    units += n;
+    busy_ns += nowNs() - begin_ns;
+  }
+
+  void report(double wall_seconds) const {
+    double busy = busy_ns / 1e9;
+    std::cout << "[STAGE] " << name << ": " << items << " items, " << units << " " << unit
+      << ", busy " << busy << " s, " << (busy > 0 ? units / busy : 0.0) << " " << unit << "/s per thread, "
+      << (wall_seconds > 0 ? units / wall_seconds : 0.0) << " " << unit << "/s overall" << std::endl;
+  }
+};
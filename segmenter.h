@@ -0,0 +1,68 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include "kaldi_io.h"
+
+// Splits recordings longer than the encoder profile at low activity frames.
+// Everything here is a pure function of the input, so the same recording is
+// always cut at the same frames.
+
+struct Segment {
+  int begin = 0; // input frames, end exclusive
+  int end = 0;
+};
+
+// mean log mel energy of every frame, smoothed over a centered window so a
+// cut lands in a pause rather than between two phones
+std::vector<float> frameEnergy(const MatrixView& feats, int smooth = 25) {
+  std::vector<float> energy(feats.rows), prefix(feats.rows + 1, 0.f);
+  for (int t = 0; t < feats.rows; ++t) {
+    float sum = 0.f;
+    for (int f = 0; f < feats.cols; ++f)
+      sum += feats.at(t, f);
+    prefix[t + 1] = prefix[t] + sum / feats.cols;
+  }
+  for (int t = 0; t < feats.rows; ++t) {
+    int lo = std::max(0, t - smooth / 2);
+    int hi = std::min(feats.rows, t + smooth / 2 + 1);
+    energy[t] = (prefix[hi] - prefix[lo]) / (hi - lo);
+  }
+  return energy;
+}
+
+// Greedy left to right: while the rest is longer than max_frames, cut at the
+// lowest activity frame of the second half of the next max_frames window.
+// Ties go to the later frame. With max_frames >= 2 * min_frames every segment
+// has min_frames .. max_frames; below that min_frames wins and only the last
+// segment may be shorter.
+std::vector<Segment> segmentByActivity(const std::vector<float>& activity, int max_frames, int min_frames) {
+  std::vector<Segment> segments;
+  int total = (int)activity.size();
+  min_frames = std::max(1, min_frames);
+  max_frames = std::max(max_frames, min_frames);
+  int start = 0;
+  while (total - start > max_frames) {
+    int lo = start + std::max(min_frames, max_frames / 2);
+    int hi = std::min(start + max_frames, total - min_frames);
+    int cut = hi;
+    for (int t = hi - 1; t >= lo; --t)
+      if (activity[t] < activity[cut])
+        cut = t;
+    // an empty window (lo > hi) leaves cut at hi, which may be too close
+    cut = std::max(start + min_frames, std::min(cut, start + max_frames));
+    segments.push_back({ start, cut });
+    start = cut;
+  }
+  segments.push_back({ start, total });
+  return segments;
+}
+
+// transcript of a recording: the tokens of its segments in segment order,
+// whatever order the segments finished in
+std::vector<int> stitchSegments(const std::vector<std::vector<int>>& tokens) {
+  std::vector<int> stitched;
+  for (auto& segment : tokens)
+    stitched.insert(stitched.end(), segment.begin(), segment.end());
+  return stitched;
+}
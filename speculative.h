@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cmath>
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include <iostream>
+#include <algorithm>
+#include "beam_search.h"
+#include "cpu_executor.h"
+
+// CTC draft speculative decoding. The greedy CTC path is taken as a draft
+// hypothesis and scored by one pass of the all positions decoder. The longest
+// prefix on which the decoder's top-1 agrees with the draft is accepted, beam
+// search resumes only from the first disagreement.
+
+// best path of log_ctc_prob [T,V]: argmax per frame, repeats merged, blanks dropped
+std::vector<int> ctcGreedy(const float* logp, int frames, int nvocab, int blank = 0) {
+  std::vector<int> tokens;
+  int prev = blank;
+  for (int t = 0; t < frames; ++t) {
+    const float* row = logp + (int64_t)t * nvocab;
+    int best = (int)(std::max_element(row, row + nvocab) - row);
+    if (best != blank && best != prev)
+      tokens.push_back(best);
+    prev = best;
+  }
+  return tokens;
+}
+
+struct DraftStats {
+  std::atomic<int64_t> drafted{ 0 };       // draft tokens offered
+  std::atomic<int64_t> accepted{ 0 };      // draft tokens kept
+  std::atomic<int64_t> full_accepts{ 0 };  // utterances finished by the draft alone
+  std::atomic<int64_t> utterances{ 0 };
+  std::atomic<int64_t> decoder_calls{ 0 }; // including the verification pass
+
+  void add(const DraftStats& other) {
+    drafted += other.drafted;
+    accepted += other.accepted;
+    full_accepts += other.full_accepts;
+    utterances += other.utterances;
+    decoder_calls += other.decoder_calls;
+  }
+
+  void report() const {
+    std::cout << "[DRAFT] accept rate " << (drafted ? 100.0 * accepted / drafted : 0.0)
+      << "% (" << accepted << "/" << drafted << " tokens), "
+      << full_accepts << "/" << utterances << " utterances fully accepted, "
+      << decoder_calls << " decoder calls" << std::endl;
+  }
+};
+
+class CtcDraftDecoder {
+public:
+  CtcDraftDecoder(CpuExecutor& full, BeamSearch& search, int sos, int eos)
+    : full(full), search(search), sos(sos), eos(eos) {}
+
+  std::vector<int> decode(const float* memory, const float* logp, int frames, int odim,
+    int nvocab, int maxlen, DraftStats& stats) {
+    std::vector<int> draft = ctcGreedy(logp, frames, nvocab);
+    if ((int)draft.size() > maxlen - 1)
+      draft.resize(std::max(0, maxlen - 1));
+
+    // words[i] predicts draft[i], the last position predicts what follows it
+    Hypothesis hyp;
+    hyp.yseq.push_back(sos);
+    hyp.yseq.insert(hyp.yseq.end(), draft.begin(), draft.end());
+    full.setInput("words", (const float*)hyp.yseq.data(), Shape{ (int)hyp.yseq.size() });
+    full.setInput("encoder", memory, Shape{ frames, odim });
+    full.run();
+    Shape shape;
+    const float* prob = full.outputData("prob", shape);
+    const int* index = (const int*)full.outputData("index", shape);
+    int k = shape.last();
+
+    int accept = 0;
+    float score = 0.f;
+    while (accept < (int)draft.size() && index[(int64_t)accept * k] == draft[accept]) {
+      score += std::log(prob[(int64_t)accept * k]);
+      ++accept;
+    }
+    stats.utterances++;
+    stats.drafted += draft.size();
+    stats.accepted += accept;
+    stats.decoder_calls++;
+
+    if (accept == (int)draft.size() && index[(int64_t)accept * k] == eos) {
+      stats.full_accepts++;
+      return draft;
+    }
+
+    // resume from the agreed prefix, the topk after it is already known
+    hyp.yseq.resize(accept + 1);
+    hyp.score = score;
+    int64_t calls = search.decoderCalls();
+    std::vector<int> tokens = search.search(memory, frames, odim, maxlen, hyp,
+      prob + (int64_t)accept * k, index + (int64_t)accept * k, k);
+    stats.decoder_calls += search.decoderCalls() - calls;
+    return tokens;
+  }
+
+private:
+  CpuExecutor& full;
+  BeamSearch& search;
+  int sos;
+  int eos;
+};
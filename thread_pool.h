@@ -0,0 +1,249 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+#include "numa.h"
+
+// Work stealing thread pool. Each worker owns a deque: it pushes and pops its
+// own tasks at the back (the follow up stage of an utterance runs where its
+// data is hot) and idle workers steal the oldest task from the front of the
+// others. With a NUMA topology the workers are dealt round robin to the nodes
+// and pinned to their cpus, a task can be routed to a node and idle workers
+// steal from their own node before crossing to another one.
+class ThreadPool {
+public:
+  ThreadPool(int n) : ThreadPool({ NumaNode() }, n) {}
+
+  ThreadPool(const std::vector<NumaNode>& nodes, int n) : node_workers(nodes.size()) {
+    for (int i = 0; i < n; ++i) {
+      int node = i % (int)nodes.size();
+      const std::vector<int>& cpus = nodes[node].cpus;
+      workers.emplace_back(new Worker());
+      workers[i]->node = node;
+      workers[i]->cpu = cpus.empty() ? -1 : cpus[(i / nodes.size()) % cpus.size()];
+      node_workers[node].push_back(i);
+    }
+    // victims: the own node in ring order first, then the other nodes
+    for (int i = 0; i < n; ++i) {
+      for (int pass = 0; pass < 2; ++pass)
+        for (int j = 1; j < n; ++j) {
+          int v = (i + j) % n;
+          if ((workers[v]->node == workers[i]->node) == (pass == 0))
+            workers[i]->victims.push_back(v);
+        }
+    }
+    for (int i = 0; i < n; ++i)
+      threads.emplace_back([this, i] { loop(i); });
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> guard(idle_lock);
+      stop = true;
+    }
+    idle.notify_all();
+    for (auto& t : threads)
+      t.join();
+  }
+
+  int size() const { return (int)workers.size(); }
+  int workerNode(int worker) const { return workers[worker]->node; }
+
+  // index of the calling pool worker, -1 for other threads
+  static int currentWorker() { return worker_id(); }
+
+  // from a worker the task goes to its own deque, otherwise round robin. A
+  // task for another node goes round robin to the workers of that node.
+  void submit(std::function<void()> task, int node = -1) {
+    int id = currentWorker();
+    if (node >= 0 && (id < 0 || workers[id]->node != node) && !node_workers[node].empty())
+      id = node_workers[node][next++ % node_workers[node].size()];
+    else if (id < 0)
+      id = (int)(next++ % workers.size());
+    pending++;
+    {
+      std::lock_guard<std::mutex> guard(workers[id]->lock);
+      workers[id]->tasks.push_back(std::move(task));
+    }
+    {
+      std::lock_guard<std::mutex> guard(idle_lock);
+      queued++;
+    }
+    idle.notify_one();
+  }
+
+  // blocks until every submitted task, including the ones they submit, ran
+  void wait() {
+    std::unique_lock<std::mutex> guard(idle_lock);
+    done.wait(guard, [this] { return pending == 0; });
+  }
+
+  int64_t steals() const { return stolen; }
+  // steals from a worker of another node
+  int64_t remoteSteals() const { return stolen_remote; }
+
+private:
+  struct Worker {
+    std::mutex lock;
+    std::deque<std::function<void()>> tasks;
+    int node = 0;
+    int cpu = -1;
+    std::vector<int> victims;
+  };
+
+  static int& worker_id() {
+    static thread_local int id = -1;
+    return id;
+  }
+
+  bool take(int id, std::function<void()>& task) {
+    {
+      Worker& own = *workers[id];
+      std::lock_guard<std::mutex> guard(own.lock);
+      if (!own.tasks.empty()) {
+        task = std::move(own.tasks.back());
+        own.tasks.pop_back();
+        return true;
+      }
+    }
+    for (int v : workers[id]->victims) {
+      Worker& victim = *workers[v];
+      std::lock_guard<std::mutex> guard(victim.lock);
+      if (!victim.tasks.empty()) {
+        task = std::move(victim.tasks.front());
+        victim.tasks.pop_front();
+        stolen++;
+        if (victim.node != workers[id]->node)
+          stolen_remote++;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void loop(int id) {
+    worker_id() = id;
+    if (workers[id]->cpu >= 0)
+      pinThread(workers[id]->cpu);
+    while (true) {
+      {
+        std::unique_lock<std::mutex> guard(idle_lock);
+        idle.wait(guard, [this] { return stop || queued > 0; });
+        if (queued == 0 && stop)
+          return;
+        queued--;
+      }
+      // a queued count is always backed by a task in some deque
+      std::function<void()> task;
+      while (!take(id, task))
+        std::this_thread::yield();
+      task();
+      if (--pending == 0) {
+        std::lock_guard<std::mutex> guard(idle_lock);
+        done.notify_all();
+      }
+    }
+  }
+
+  std::vector<std::unique_ptr<Worker>> workers;
+  std::vector<std::vector<int>> node_workers;
+  std::vector<std::thread> threads;
+  std::mutex idle_lock;
+  std::condition_variable idle;
+  std::condition_variable done;
+  int64_t queued = 0;
+  bool stop = false;
+  std::atomic<int64_t> pending{ 0 };
+  std::atomic<int64_t> stolen{ 0 };
+  std::atomic<int64_t> stolen_remote{ 0 };
+  std::atomic<unsigned> next{ 0 };
+};
+
+// Fork join over a fixed set of threads for the data parallel kernels of one
+// executor: run(n, fn) calls fn(task, thread) for every task < n and returns
+// when all of them finished. The calling thread is thread 0 and takes tasks
+// as well. Nothing is allocated per call.
+class ParallelFor {
+public:
+  ParallelFor(int n) {
+    for (int i = 1; i < n; ++i)
+      threads.emplace_back([this, i] { loop(i); });
+  }
+
+  ~ParallelFor() {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      stop = true;
+      generation++;
+    }
+    start.notify_all();
+    for (auto& t : threads)
+      t.join();
+  }
+
+  int size() const { return (int)threads.size() + 1; }
+
+  template <typename F>
+  void run(int tasks, const F& fn) {
+    if (threads.empty() || tasks <= 1) {
+      for (int i = 0; i < tasks; ++i)
+        fn(i, 0);
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      body = [](const void* context, int task, int thread) { (*(const F*)context)(task, thread); };
+      context = &fn;
+      total = tasks;
+      next = 0;
+      busy = (int)threads.size();
+      generation++;
+    }
+    start.notify_all();
+    work(0);
+    std::unique_lock<std::mutex> guard(lock);
+    finished.wait(guard, [this] { return busy == 0; });
+  }
+
+private:
+  void work(int thread) {
+    int task;
+    while ((task = next++) < total)
+      body(context, task, thread);
+  }
+
+  void loop(int thread) {
+    int64_t seen = 0;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> guard(lock);
+        start.wait(guard, [&] { return generation != seen; });
+        seen = generation;
+        if (stop)
+          return;
+      }
+      work(thread);
+      std::lock_guard<std::mutex> guard(lock);
+      if (--busy == 0)
+        finished.notify_all();
+    }
+  }
+
+  std::vector<std::thread> threads;
+  std::mutex lock;
+  std::condition_variable start;
+  std::condition_variable finished;
+  void (*body)(const void*, int, int) = nullptr;
+  const void* context = nullptr;
+  int total = 0;
+  int busy = 0;
+  std::atomic<int> next{ 0 };
+  int64_t generation = 0;
+  bool stop = false;
+};
@@ -6,6 +6,7 @@
 #include <fstream>
 #include <iostream>
 #include <NvInfer.h>
+#include "ir.h"
 
 using namespace nvinfer1;
 
@@ -17,27 +18,9 @@ void logTensorInfo(ITensor* tensor, std::string name) {
   std::cout << std::endl;
 }
 
-char* fromFile(std::string file, size_t size) {
-  std::cout << "loading weight from " << file << std::endl;
-  std::ifstream ifs(file, std::ios::binary);
-  if (ifs.fail()) {
-    std::cout << file << " open fail!" << std::endl;
-    exit(0);
-  }
-  ifs.seekg(0, std::ios::end);
-  size_t len = ifs.tellg();
-  ifs.seekg(0, std::ios::beg);
-  assert(len == size);
-  char* tmp_ptr = (char*)malloc(len);
-  ifs.read(tmp_ptr, len);
-  ifs.close();
-  return tmp_ptr;
-}
-
-Weights getWeight(std::string file, size_t size) {
-  char*tmp = fromFile(file, size);
-  Weights weight{ DataType::kFLOAT, tmp,(int64_t)size / sizeof(float) };
-  return weight;
+Weights toWeights(const Weight& weight) {
+  Weights weights{ DataType::kFLOAT, weight.values, weight.count };
+  return weights;
 }
 
 ITensor* PositionWise(
@@ -46,10 +29,9 @@ ITensor* PositionWise(
   const int seql,
   const int odim,
   const DataType dtype,
-  std::string prefix) {
+  Weights pe) {
 
   int data[] = { seql ,odim ,(int)dtype };
-  auto pe = getWeight(prefix, seql*odim * sizeof(float));
 
   std::vector<PluginField> vpf{
     PluginField("args",data,PluginFieldType::kINT32,(int32_t)3),
@@ -69,15 +51,17 @@ ITensor* FC(
   ITensor* input,
   const int insize,
   const int outsize,
-  std::string prefix) {
-
-  Weights weight = getWeight(prefix + ".weight", insize*outsize * sizeof(float));
-  Weights bias = getWeight(prefix + ".bias", outsize * sizeof(float));
+  Weights weight, Weights bias,
+  bool transposed) {
 
-  auto w = network->addConstant(DimsHW(outsize, insize), weight)->getOutput(0);
+  // pre-transposed weights are stored [in,out] and need no transpose at runtime
+  auto w = transposed ?
+    network->addConstant(DimsHW(insize, outsize), weight)->getOutput(0) :
+    network->addConstant(DimsHW(outsize, insize), weight)->getOutput(0);
   auto b = network->addConstant(DimsHW(1, outsize), bias)->getOutput(0);
 
-  auto fc = network->addMatrixMultiply(*input, MatrixOperation::kNONE, *w, MatrixOperation::kTRANSPOSE)->getOutput(0);
+  auto fc = network->addMatrixMultiply(*input, MatrixOperation::kNONE, *w,
+    transposed ? MatrixOperation::kNONE : MatrixOperation::kTRANSPOSE)->getOutput(0);
   auto fb = network->addElementWise(*fc, *b, ElementWiseOperation::kSUM)->getOutput(0);
 
   return fb;
@@ -86,11 +70,8 @@ ITensor* FC(
 ITensor* LayerNormalization(
   INetworkDefinition *network,
   ITensor* input,
-  const int odim,
-  std::string prefix) {
-
-  auto gamma = getWeight(prefix + ".weight", odim * sizeof(float));
-  auto beta = getWeight(prefix + ".bias", odim * sizeof(float));
+  Weights gamma,
+  Weights beta) {
 
   std::vector<PluginField> vpf{
     PluginField("gamma",gamma.values,PluginFieldType::kFLOAT32,(int32_t)gamma.count),
@@ -105,31 +86,12 @@ ITensor* LayerNormalization(
   return bottom;
 }
 
-ITensor* FeedForward(
-  INetworkDefinition *network,
-  ITensor* input,
-  const int odim,
-  const int feed,
-  std::string prefix) {
-
-  auto fc1 = FC(network, input, odim, feed, prefix + ".feed_forward.w_1");
-  auto fb1 = network->addActivation(*fc1, ActivationType::kRELU)->getOutput(0);
-  auto fc2 = FC(network, fb1, feed, odim, prefix + ".feed_forward.w_2");
-
-  return fc2;
-}
-
 ITensor* SelfAttention(
   INetworkDefinition *network,
-  ITensor* input,
+  ITensor* q, ITensor* k, ITensor* v,
   const int n_Head,
   const int odim,
-  const int mask,
-  std::string prefix) {
-
-  auto q = FC(network, input, odim, odim, prefix + ".self_attn.linear_q");
-  auto k = FC(network, input, odim, odim, prefix + ".self_attn.linear_k");
-  auto v = FC(network, input, odim, odim, prefix + ".self_attn.linear_v");
+  const int mask) {
 
   int data[] = { n_Head, odim , mask };
   std::vector<PluginField> vpf{
@@ -142,28 +104,20 @@ ITensor* SelfAttention(
   IPluginV2 *plugin = creator->createPlugin("", &pfc);
   std::vector<ITensor*> vit{ q,k,v };
   auto bottom = network->addPluginV2(vit.data(), vit.size(), *plugin)->getOutput(0);
-
-  auto out = FC(network, input, odim, odim, prefix + ".self_attn.linear_out");
-  return out;
+  return bottom;
 }
 
 ITensor* SrcAttention(
   INetworkDefinition* network,
-  ITensor* input, ITensor* encoder,
+  ITensor* q, ITensor* encoder,
   const int n_Head,
   const int odim,
   const DataType dtype,
-  std::string prefix) {
-  auto q = FC(network, input, odim, odim, prefix + ".src_attn.linear_q");
+  Weights kWeight, Weights kBias,
+  Weights vWeight, Weights vBias) {
 
   int data[] = { n_Head, odim ,(int)dtype };
 
-  auto kWeight = getWeight(prefix + ".src_attn.linear_k.weight", odim*odim * sizeof(float));
-  auto kBias = getWeight(prefix + ".src_attn.linear_k.bias", odim * sizeof(float));
-
-  auto vWeight = getWeight(prefix + ".src_attn.linear_v.weight", odim*odim * sizeof(float));
-  auto vBias = getWeight(prefix + ".src_attn.linear_v.bias", odim * sizeof(float));
-
   std::vector<PluginField> vpf{
     PluginField("args",data,PluginFieldType::kFLOAT32,(int32_t)3),
     PluginField("kweight",kWeight.values,PluginFieldType::kFLOAT32,(int32_t)kWeight.count),
@@ -178,15 +132,12 @@ ITensor* SrcAttention(
   IPluginV2 *plugin = creator->createPlugin("", &pfc);
   std::vector<ITensor*> vit{ q,encoder };
   auto bottom = network->addPluginV2(vit.data(), vit.size(), *plugin)->getOutput(0);
-
-  auto out = FC(network, bottom, odim, odim, prefix + ".src_attn.linear_out");
-  return out;
+  return bottom;
 }
 
 ITensor* FinalSlice(
   INetworkDefinition* network,
-  ITensor* input,
-  std::string prefix) {
+  ITensor* input) {
   PluginFieldCollection pfc;
   auto creator = getPluginRegistry()->getPluginCreator(
     "FinalSlice_TRT", "001", "");
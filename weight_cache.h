@@ -0,0 +1,227 @@
+#pragma once
+
+#include <map>
+#include <set>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+#include "ir.h"
+#include "kaldi_io.h"
+
+// Process wide weight store for hosting several models that share tensors
+// (fine tuned variants of one base model). Weight files are mapped, hashed
+// and compared byte for byte with what is already resident; identical tensors
+// resolve to one mapped copy whatever the --path they came from. Constants the
+// passes derive from shared tensors are shared as well, so a frozen layer
+// costs its transposed / packed copy only once.
+
+// FNV-1a over 64 bit words, the tail bytes one at a time
+uint64_t hashBytes(const void* data, size_t bytes) {
+  const uint64_t prime = 1099511628211ull;
+  uint64_t hash = 14695981039346656037ull;
+  const char* p = (const char*)data;
+  size_t words = bytes / 8;
+  for (size_t i = 0; i < words; ++i) {
+    uint64_t w;
+    memcpy(&w, p + i * 8, 8);
+    hash = (hash ^ w) * prime;
+  }
+  for (size_t i = words * 8; i < bytes; ++i)
+    hash = (hash ^ (unsigned char)p[i]) * prime;
+  return hash;
+}
+
+// Holds no tensor itself: entries are weak references to the weights the
+// graphs own, a tensor no graph uses any more is unmapped / freed as usual.
+// Every resident tensor has a content id, the hash of its bytes for loaded
+// ones and the hash of op and source ids for derived ones, so a derived
+// constant is found again even after the model that made it dropped its
+// sources (a transposed FC no longer holds the [out,in] original).
+class WeightCache {
+public:
+  // the weight stored in file, mapped once per distinct content
+  Weight load(const std::string& file, int64_t count) {
+    auto mapping = std::make_shared<MappedFile>(file);
+    if (mapping->size() != (size_t)count * sizeof(float)) {
+      std::cout << file << " size mismatch, expect " << count * sizeof(float) << " got " << mapping->size() << std::endl;
+      exit(0);
+    }
+    Weight weight;
+    weight.values = (const float*)mapping->data();
+    weight.count = count;
+    weight.owner = mapping;
+    uint64_t id = hashBytes(weight.values, mapping->size());
+
+    std::lock_guard<std::mutex> guard(lock);
+    auto& candidates = by_hash[id];
+    for (auto it = candidates.begin(); it != candidates.end();) {
+      Weight resident;
+      if (!alive(*it, resident)) {
+        it = candidates.erase(it);
+        continue;
+      }
+      // loaded tensors are compared byte for byte, the hash only finds them
+      if (resident.count == count && memcmp(resident.values, weight.values, mapping->size()) == 0) {
+        deduplicated++;
+        std::cout << "sharing weight from " << file << std::endl;
+        return resident;
+      }
+      ++it;
+    }
+    std::cout << "loading weight from " << file << std::endl;
+    candidates.push_back(remember(weight, id));
+    return weight;
+  }
+
+  // op applied to sources, computed once for the same op on the same content
+  Weight derive(const std::string& op, const std::vector<Weight>& sources,
+    const std::function<Weight()>& make) {
+    std::string key = op;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      for (auto& source : sources) {
+        uint64_t id;
+        if (!contentId(source, id))
+          return make(); // not from this cache, nothing to share
+        key += " " + std::to_string(id) + ":" + std::to_string(source.count);
+      }
+      Weight resident;
+      auto it = by_key.find(key);
+      if (it != by_key.end() && alive(it->second, resident)) {
+        deduplicated++;
+        return resident;
+      }
+    }
+    Weight weight = make();
+    std::lock_guard<std::mutex> guard(lock);
+    Weight resident;
+    auto it = by_key.find(key);
+    if (it != by_key.end() && alive(it->second, resident))
+      return resident;
+    by_key[key] = remember(weight, hashBytes(key.data(), key.size()));
+    return weight;
+  }
+
+  int64_t deduplicatedTensors() const { return deduplicated; }
+
+private:
+  struct Entry {
+    const float* values = nullptr;
+    int64_t count = 0;
+    uint64_t id = 0;
+    std::weak_ptr<const void> owner;
+  };
+
+  Entry remember(const Weight& weight, uint64_t id) {
+    Entry e;
+    e.values = weight.values;
+    e.count = weight.count;
+    e.id = id;
+    e.owner = weight.owner;
+    by_address[weight.values] = e;
+    return e;
+  }
+
+  bool alive(const Entry& e, Weight& weight) {
+    weight.owner = e.owner.lock();
+    weight.values = e.values;
+    weight.count = e.count;
+    return weight.owner != nullptr;
+  }
+
+  // the address alone could belong to a tensor freed since, the owner has
+  // to be the same object
+  bool contentId(const Weight& weight, uint64_t& id) {
+    auto it = by_address.find(weight.values);
+    if (it == by_address.end())
+      return false;
+    Weight resident;
+    if (!alive(it->second, resident) || resident.owner != weight.owner ||
+      resident.count != weight.count) {
+      by_address.erase(it);
+      return false;
+    }
+    id = it->second.id;
+    return true;
+  }
+
+  std::mutex lock;
+  std::map<uint64_t, std::vector<Entry>> by_hash;
+  std::map<std::string, Entry> by_key;
+  std::map<const float*, Entry> by_address;
+  std::atomic<int64_t> deduplicated{ 0 };
+};
+
+// WeightLoader of one model backed by a shared WeightCache.
+class SharedWeightLoader : public WeightLoader {
+public:
+  SharedWeightLoader(WeightCache& cache) : cache(cache) {}
+
+  Weight load(const std::string& file, int64_t count) override {
+    return cache.load(file, count);
+  }
+
+  Weight derive(const std::string& op, const std::vector<Weight>& sources,
+    const std::function<Weight()>& make) override {
+    return cache.derive(op, sources, make);
+  }
+
+private:
+  WeightCache& cache;
+};
+
+struct WeightUsage {
+  int64_t referenced = 0; // bytes of all constants the model's graphs hold
+  int64_t exclusive = 0;  // bytes no other model holds
+  int64_t shared = 0;     // bytes held by two or more models
+  int64_t charged = 0;    // every tensor split evenly among its holders
+};
+
+// Resident weight bytes per model, from the constants its graphs actually
+// hold after the passes. Storage is identified by address, so a tensor
+// shared through the cache is counted once in total.
+std::map<std::string, WeightUsage> weightUsage(
+  const std::map<std::string, std::vector<const Graph*>>& models, int64_t& resident) {
+  std::map<const float*, std::pair<int64_t, std::set<std::string>>> tensors;
+  for (auto& kv : models)
+    for (const Graph* graph : kv.second)
+      for (auto& node : graph->nodes)
+        for (auto& weight : node.weights) {
+          auto& tensor = tensors[weight.values];
+          tensor.first = weight.count * (int64_t)sizeof(float);
+          tensor.second.insert(kv.first);
+        }
+  std::map<std::string, WeightUsage> usage;
+  resident = 0;
+  for (auto& kv : tensors) {
+    int64_t bytes = kv.second.first;
+    const std::set<std::string>& holders = kv.second.second;
+    resident += bytes;
+    for (auto& model : holders) {
+      WeightUsage& u = usage[model];
+      u.referenced += bytes;
+      (holders.size() > 1 ? u.shared : u.exclusive) += bytes;
+      u.charged += bytes / (int64_t)holders.size();
+    }
+  }
+  return usage;
+}
+
+void logWeightUsage(const std::map<std::string, std::vector<const Graph*>>& models) {
+  int64_t resident = 0, referenced = 0;
+  for (auto& kv : weightUsage(models, resident)) {
+    const WeightUsage& u = kv.second;
+    referenced += u.referenced;
+    std::cout << "[WEIGHTS] " << kv.first << ": " << u.referenced / 1048576.0 << " MB referenced, "
+      << u.exclusive / 1048576.0 << " MB exclusive, " << u.shared / 1048576.0 << " MB shared, "
+      << u.charged / 1048576.0 << " MB charged" << std::endl;
+  }
+  std::cout << "[WEIGHTS] resident " << resident / 1048576.0 << " MB for " << referenced / 1048576.0
+    << " MB referenced" << std::endl;
+}